@@ -0,0 +1,151 @@
+﻿// rlib batch
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../json/Json.h"
+#include "../parallel/Parallel.h"
+
+namespace rlib::batch {
+
+	// 変換対象のファイル
+	struct Item {
+		std::filesystem::path	input;		// 入力ファイル
+		std::filesystem::path	relative;	// 出力先ディレクトリからの相対パス(拡張子は入力のまま)
+		std::string				error;		// 列挙時に判明したエラー(変換せずに失敗として報告する)
+	};
+
+	// 変換対象の列挙
+	// input がディレクトリなら、その下(サブディレクトリを含む)で拡張子が extensions のいずれかのファイル
+	// ファイルなら1行に1つ入力ファイルのパスを書いたリストファイル(空行と # で始まる行は無視。相対パスはリストファイルの位置から)
+	// 出力先ディレクトリの外を指す相対パスと、出力先が(拡張子を除いて)先の入力と重なる入力は error を設定する
+	inline std::vector<Item> listInputs(const std::filesystem::path& input, const std::vector<std::string>& extensions) {
+		namespace fs = std::filesystem;
+		std::vector<Item> items;
+		if (fs::is_directory(input)) {
+			const auto matchExtension = [&extensions](const fs::path& path) {
+				auto ext = path.extension().string();
+				std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) {return static_cast<char>(std::tolower(c)); });
+				return std::find(extensions.begin(), extensions.end(), ext) != extensions.end();
+			};
+			for (const auto& entry : fs::recursive_directory_iterator(input)) {
+				if (entry.is_regular_file() && matchExtension(entry.path())) {
+					items.push_back({ entry.path(), entry.path().lexically_relative(input) });
+				}
+			}
+			std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {return a.input < b.input; });	// 列挙順はファイルシステム依存なので揃える
+		} else {
+			std::ifstream list(input);
+			if (list.fail()) throw std::runtime_error("input file open error.");
+			for (std::string line; std::getline(list, line);) {
+				if (!line.empty() && line.back() == '\r') line.pop_back();
+				if (line.empty() || line.front() == '#') continue;
+				const fs::path path(line);
+				Item item{
+					path.is_absolute() ? path : input.parent_path() / path,
+					path.is_absolute() ? path.filename() : path.lexically_normal(),
+				};
+				if (item.relative.empty() || item.relative.has_root_path() || *item.relative.begin() == "..") {
+					item.error = "output path is outside the output directory: " + line;
+				}
+				items.emplace_back(std::move(item));
+			}
+		}
+
+		// 出力先の重複(並列に同じファイルへ書き込まないように、2つ目以降は失敗にする)
+		std::map<fs::path, const Item*> outputs;		// <拡張子を除いた出力先,最初の入力>
+		for (auto& item : items) {
+			if (!item.error.empty()) continue;
+			const auto [i, inserted] = outputs.emplace(fs::path(item.relative).replace_extension(), &item);
+			if (!inserted) {
+				item.error = "output path conflicts with " + i->second->input.string();
+			}
+		}
+		return items;
+	}
+
+	// 出力ファイルのパス(ディレクトリがなければ作る)
+	inline std::filesystem::path outputPath(const std::filesystem::path& outputDirectory, const Item& item, const std::string& extension) {
+		auto path = (outputDirectory / item.relative).replace_extension(extension);
+		std::error_code ec;
+		std::filesystem::create_directories(path.parent_path(), ec);	// 他のスレッドが作成済みの場合もあるのでエラーは無視(書き込み時に判明する)
+		return path;
+	}
+
+	// items を jobs 個のスレッドで変換し、結果の集計を JSON で返す
+	// convert(item, log) は1ファイルを変換する。失敗は例外で通知し、警告は log へ出力する
+	// 1ファイルの失敗で全体は止めない
+	template <typename F> Json run(const std::vector<Item>& items, size_t jobs, F&& convert) {
+		struct Report {
+			bool		ok = false;
+			std::string	message;	// 失敗時のエラー
+			std::string	warnings;
+		};
+		std::vector<Report> reports(items.size());
+
+		jobs = parallel::resolveThreads(jobs);
+		const auto start = std::chrono::steady_clock::now();
+		parallel::forEach(items.size(), jobs, [&](size_t i) {
+			auto& report = reports[i];
+			if (!items[i].error.empty()) {
+				report.message = items[i].error;
+				return;
+			}
+			std::ostringstream log;
+			try {
+				convert(items[i], log);
+				report.ok = true;
+			} catch (const std::exception& e) {
+				report.message = e.what();
+			} catch (...) {
+				report.message = "unknown exception";
+			}
+			report.warnings = log.str();
+		});
+		const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+		Json json;
+		auto& summary = json.ensureMap();
+		auto& failures = summary["failures"].ensureArray();
+		auto& warnings = summary["warnings"].ensureArray();
+		size_t succeeded = 0;
+		for (size_t i = 0; i < items.size(); i++) {
+			const auto& report = reports[i];
+			const auto input = items[i].input.u8string();
+			if (report.ok) {
+				succeeded++;
+			} else {
+				failures.push_back(Json::Map{
+					{"input",	input},
+					{"message",	report.message},
+				});
+			}
+			if (!report.warnings.empty()) {
+				Json::Array lines;
+				std::istringstream is(report.warnings);
+				for (std::string line; std::getline(is, line);) lines.push_back(line);
+				warnings.push_back(Json::Map{
+					{"input",		input},
+					{"messages",	lines},
+				});
+			}
+		}
+		summary["files"] = items.size();
+		summary["succeeded"] = succeeded;
+		summary["failed"] = items.size() - succeeded;
+		summary["jobs"] = jobs;
+		summary["seconds"] = seconds.count();
+		summary["filesPerSecond"] = seconds.count() > 0 ? items.size() / seconds.count() : 0.0;
+		return json;
+	}
+
+}
@@ -0,0 +1,97 @@
+﻿
+// SMF 書き出しのヒープ確保回数のベンチマーク
+// NoteOn/NoteOff を並べたトラックを、以前の書き出し方(イベント毎に smfBytes() と getVariableValue() の vector を作る)と
+// Smf::getFileImage() で書き出して、イベントあたりの確保回数と時間を比べる
+//	usage: allocbench [ノート数(既定:1000000)]
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../sequencer/Smf.h"
+
+namespace {
+	size_t allocations = 0;		// operator new の呼び出し回数
+}
+
+void* operator new(std::size_t size) {
+	allocations++;
+	if (void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+using namespace rlib::midi;
+
+// 以前の可変長数値作成(値毎に vector を作る)
+static std::vector<uint8_t> getVariableValue(uint64_t n) {
+	std::vector<uint8_t> v(utility::getVariableValueSize(n));
+	utility::writeVariableValue(n, v.data());
+	return v;
+}
+
+// 以前の書き出し方(トラックのデータ部のみ)
+static std::vector<uint8_t> encodeWithVectors(const Smf::Track& track) {
+	std::vector<uint8_t> result;
+	size_t position = 0;
+	for (const auto& [eventPosition, event] : track.events()) {
+		const auto delta = getVariableValue(eventPosition - position);
+		const auto bytes = event->smfBytes();
+		result.insert(result.end(), delta.begin(), delta.end());
+		result.insert(result.end(), bytes.begin(), bytes.end());
+		position = eventPosition;
+	}
+	const auto delta = getVariableValue(0);
+	const auto bytes = EventMeta::createEndOfTrack().smfBytes();
+	result.insert(result.end(), delta.begin(), delta.end());
+	result.insert(result.end(), bytes.begin(), bytes.end());
+	return result;
+}
+
+int main(const int argc, const char* const argv[])
+{
+	const size_t notes = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+	Smf smf;
+	{
+		Smf::TrackBuilder builder;
+		builder.reserve(notes * 2);
+		for (size_t i = 0; i < notes; i++) {
+			const uint8_t note = static_cast<uint8_t>(36 + i % 48);
+			builder.add(i * 120, std::make_shared<EventNoteOn>(0, note, 100));
+			builder.add(i * 120 + 100, std::make_shared<EventNoteOff>(0, note, 0));
+		}
+		smf.tracks.emplace_back(builder.build());
+	}
+	const size_t events = notes * 2;
+
+	const auto measure = [&](const char* name, auto f) {
+		allocations = 0;
+		const auto begin = std::chrono::steady_clock::now();
+		auto r = f();
+		const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+		const size_t count = allocations;
+		std::cout << name << ": " << count << " allocations, " << static_cast<double>(count) / events << " per event, " << elapsed.count() << " ms" << std::endl;
+		return r;
+	};
+
+	const auto before = measure("smfBytes/getVariableValue", [&] { return encodeWithVectors(smf.tracks.front()); });
+	const auto after = measure("Smf::getFileImage        ", [&] { return smf.getFileImage(); });
+
+	// 同じ内容か(getFileImage はヘッダ(14Byte)とトラックのチャンクヘッダ(8Byte)の後がデータ部)
+	constexpr size_t headerSize = 14 + 8;
+	if (after.size() != headerSize + before.size() || std::memcmp(after.data() + headerSize, before.data(), before.size()) != 0) {
+		std::cerr << "output mismatch" << std::endl;
+		return 1;
+	}
+	return 0;
+}
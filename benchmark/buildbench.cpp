@@ -0,0 +1,104 @@
+﻿
+// トラック構築のベンチマーク
+// mmlToSmf と同じ順序(NoteOn の位置順に NoteOn と先の位置の NoteOff を交互に追加)で、
+// Track::events へ1つずつ insert する場合と Smf::TrackBuilder でまとめて作る場合を比べる
+// 両者のイベントの並びが同じかも確認する。ヒープ確保回数(operator new の呼び出し回数)も数える
+//	usage: buildbench [イベント数(既定:1000000)] [回数(既定:9)]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../sequencer/Smf.h"
+
+namespace {
+	size_t allocations = 0;		// operator new の呼び出し回数
+}
+
+void* operator new(std::size_t size) {
+	allocations++;
+	if (void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {		// EventArena(std::pmr)はこちらで確保する
+	allocations++;
+	const auto align = static_cast<std::size_t>(alignment);
+	if (void* p = std::aligned_alloc(align, (size + align - 1) / align * align)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+using namespace rlib::midi;
+
+int main(const int argc, const char* const argv[])
+{
+	const size_t events = argc > 1 ? std::stoul(argv[1]) : 1000000;
+	const size_t repeat = argc > 2 ? std::stoul(argv[2]) : 9;
+
+	// 追加するイベント(NoteOff は次の NoteOn より先の位置)
+	std::vector<std::pair<size_t, std::shared_ptr<const Event>>> input;
+	input.reserve(events);
+	for (size_t i = 0; input.size() < events; i++) {
+		const uint8_t note = static_cast<uint8_t>(36 + i % 48);
+		const size_t length = 60 + (i % 4) * 60;		// 音符の間隔(120)より長いものもある
+		input.emplace_back(i * 120, std::make_shared<EventNoteOn>(0, note, 100));
+		input.emplace_back(i * 120 + length, std::make_shared<EventNoteOff>(0, note, 0));
+	}
+	input.resize(events);
+
+	const auto measure = [&](const char* name, auto f) {
+		double best = (std::numeric_limits<double>::max)();
+		size_t count = 0;
+		Smf::Track track;
+		for (size_t i = 0; i < repeat; i++) {
+			allocations = 0;
+			const auto begin = std::chrono::steady_clock::now();
+			auto built = f();
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			count = allocations;
+			track = std::move(built);		// 前回のトラックの破棄は計測に含めない
+			best = (std::min)(best, elapsed.count());
+		}
+		std::cout << name << ": " << best << " ms (best of " << repeat << "), " << count << " allocations" << std::endl;
+		return track;
+	};
+
+	for (const bool useArena : { false, true }) {
+		std::cout << (useArena ? "arena" : "heap") << ", " << events << " events" << std::endl;
+		const auto inserted = measure("  multimap::insert", [&] {
+			Smf::Track track(useArena ? std::make_shared<EventArena>() : nullptr);
+			auto& list = track.mutableEvents();
+			for (const auto& e : input) list.insert(e);
+			return track;
+		});
+		const auto built = measure("  TrackBuilder    ", [&] {
+			Smf::TrackBuilder builder(useArena ? std::make_shared<EventArena>() : nullptr);
+			builder.reserve(input.size());
+			for (const auto& e : input) builder.add(e.first, e.second);
+			return builder.build();
+		});
+		if (!std::equal(inserted.events().begin(), inserted.events().end(), built.events().begin(), built.events().end())) {
+			std::cerr << "event order differs" << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
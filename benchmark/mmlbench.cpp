@@ -0,0 +1,64 @@
+﻿
+// MML コンパイルのベンチマーク
+// コマンドの種類ごとに MML を生成して MmlCompiler::compile の時間を計測する
+//	usage: mmlbench [行数(既定:20000)] [回数(既定:5)]
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "../sequencer/MmlCompiler.h"
+
+using namespace rlib::sequencer;
+
+int main(const int argc, const char* const argv[])
+{
+	const size_t lines = argc > 1 ? std::stoul(argv[1]) : 20000;
+	const size_t repeat = argc > 2 ? std::stoul(argv[2]) : 5;
+
+	struct Case {
+		const char*	name;
+		const char*	line;		// 1行分の MML
+		size_t		commands;	// 1行あたりのコマンド数
+	};
+	const Case cases[] = {
+		// 音符(音長・付点・臨時記号・タイ・休符・オクターブ指定を含む)
+		{ "notes",		"o4 l8 c d16 e-4. f+ g2^8 a!120 b <c> r8 c+16. d-32 e f g a b8.. >c<\n", 16 },
+		// 休符・タイ
+		{ "rest/tie",	"r r8 r16. r4^8 c^16^32 r2 r!60 c4^4 r\n", 13 },
+		// 音長・オクターブ・ベロシティ・音色・テンポ
+		{ "l/o/v/@/t",	"l8 o5 v100 @1 t120 l4 o3 v+10 @2 t90.5 < > c\n", 13 },
+		// 関数形式
+		{ "functions",	"V(100) Volume(90) Ep(64) CC(10,64) ControlChange(no:11, value:127) Pan(-10) PitchBend(100) c\n", 8 },
+	};
+
+	for (const auto& c : cases) {
+		const std::string line = c.line;
+		std::string mml;
+		mml.reserve(line.size() * lines);
+		for (size_t i = 0; i < lines; i++) {
+			mml += line;
+		}
+		const auto source = std::make_shared<const std::string>(std::move(mml));
+
+		double best = (std::numeric_limits<double>::max)();
+		for (size_t i = 0; i < repeat; i++) {
+			const auto begin = std::chrono::steady_clock::now();
+			const auto r = MmlCompiler::compile(source);
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			if (r.hasError()) {
+				std::cerr << c.name << ": " << r.getText(r.errors) << std::endl;
+				return 1;
+			}
+			best = (std::min)(best, elapsed.count());
+		}
+
+		const size_t commands = c.commands * lines;
+		std::cout << c.name << ": " << commands << " commands, " << source->size() << " bytes, "
+			<< best << " ms (best of " << repeat << "), " << static_cast<size_t>(commands / best * 1000) << " commands/s" << std::endl;
+	}
+	return 0;
+}
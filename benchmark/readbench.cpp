@@ -0,0 +1,113 @@
+﻿
+// SMF 読み込みのベンチマーク(コーパスの走査)
+// 指定したファイル(ディレクトリなら中の .mid/.midi)をすべて読み込み、読み込み方・ReadOptions 毎に合計時間を計測する
+// イベント数を数えるのでトラックは最後までデコードする。Event を作らずに TrackReader で走査する場合も計測する
+//	usage: readbench 回数 ファイル or ディレクトリ...
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "../sequencer/Smf.h"
+
+using namespace rlib::midi;
+
+int main(const int argc, const char* const argv[])
+{
+	if (argc < 3) {
+		std::cerr << "usage: readbench repeat file|directory..." << std::endl;
+		return 1;
+	}
+	const size_t repeat = std::stoul(argv[1]);
+
+	std::vector<std::filesystem::path> files;
+	for (int i = 2; i < argc; i++) {
+		if (std::filesystem::is_directory(argv[i])) {
+			for (const auto& entry : std::filesystem::recursive_directory_iterator(argv[i])) {
+				const auto ext = entry.path().extension();
+				if (entry.is_regular_file() && (ext == ".mid" || ext == ".midi")) files.push_back(entry.path());
+			}
+		} else {
+			files.emplace_back(argv[i]);
+		}
+	}
+	std::sort(files.begin(), files.end());
+	size_t bytes = 0;
+	for (const auto& file : files) bytes += std::filesystem::file_size(file);
+
+	std::ofstream nullLog;		// 警告は捨てる(badbit のストリームには何も書かれない)
+	nullLog.setstate(std::ios::badbit);
+
+	struct Case {
+		const char*	name;
+		bool		stream;		// fromStream(ifstream) で読む(false:fromFile)
+		bool		arena;
+		bool		intern;
+		bool		borrowPayload;
+	};
+	const Case cases[] = {
+		{ "fromStream, no arena/intern/borrow", true,  false, false, false },
+		{ "fromFile,   no arena/intern/borrow", false, false, false, false },
+		{ "fromFile,   arena                 ", false, true,  false, false },
+		{ "fromFile,   arena+intern          ", false, true,  true,  false },
+		{ "fromFile,   arena+intern+borrow   ", false, true,  true,  true },
+	};
+
+	const auto report = [&](const char* name, double best, size_t events) {
+		std::cout << name << ": " << best << " ms (best of " << repeat << "), " << events << " events, "
+			<< bytes / (1024.0 * 1024.0) / (best / 1000) << " MB/s" << std::endl;
+	};
+
+	std::cout << files.size() << " files, " << bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+	for (const auto& c : cases) {
+		Smf::ReadOptions options;
+		options.log = &nullLog;
+		options.arena = c.arena;
+		options.intern = c.intern;
+		options.borrowPayload = c.borrowPayload;
+
+		double best = (std::numeric_limits<double>::max)();
+		size_t events = 0;
+		for (size_t i = 0; i < repeat; i++) {
+			events = 0;
+			const auto begin = std::chrono::steady_clock::now();
+			for (const auto& file : files) {
+				const auto smf = [&] {
+					if (!c.stream) return Smf::fromFile(file, options);
+					std::ifstream is(file, std::ios::binary);
+					return Smf::fromStream(is, options);
+				}();
+				for (const auto& track : smf.tracks) events += track.events().size();
+			}
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			best = (std::min)(best, elapsed.count());
+		}
+		report(c.name, best, events);
+	}
+
+	// Event を作らず、トラック毎に TrackReader で EventView を読むだけ
+	{
+		double best = (std::numeric_limits<double>::max)();
+		size_t events = 0;
+		for (size_t i = 0; i < repeat; i++) {
+			events = 0;
+			const auto begin = std::chrono::steady_clock::now();
+			for (const auto& file : files) {
+				const auto reader = SmfReader::fromFile(file);
+				for (size_t t = 0; t < reader.trackCount(); t++) {
+					auto track = reader.track(t);
+					while (track.next()) events++;
+				}
+			}
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			best = (std::min)(best, elapsed.count());
+		}
+		report("TrackReader(EventView only)        ", best, events);
+	}
+	return 0;
+}
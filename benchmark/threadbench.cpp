@@ -0,0 +1,79 @@
+﻿
+// SMF 書き出しのスレッド数によるスケーリングのベンチマーク
+// 多数のトラックを持つ Smf を WriteOptions::threads を変えて getFileImage()/write() し、時間を計測する
+// 並列に書き出した結果が逐次(threads=1)の結果と同じかも確認する
+//	usage: threadbench [トラック数(既定:48)] [トラックあたりのノート数(既定:40000)] [回数(既定:5)]
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../sequencer/Smf.h"
+
+using namespace rlib::midi;
+
+int main(const int argc, const char* const argv[])
+{
+	const size_t tracks = argc > 1 ? std::stoul(argv[1]) : 48;
+	const size_t notes = argc > 2 ? std::stoul(argv[2]) : 40000;
+	const size_t repeat = argc > 3 ? std::stoul(argv[3]) : 5;
+
+	Smf smf;
+	for (size_t t = 0; t < tracks; t++) {
+		const uint8_t channel = static_cast<uint8_t>(t % 16);
+		Smf::TrackBuilder builder;
+		builder.reserve(notes * 3 + 1);
+		builder.add(0, std::make_shared<EventMeta>(EventMeta::createText(EventMeta::Type::sequenceName, "track" + std::to_string(t))));
+		for (size_t i = 0; i < notes; i++) {
+			const uint8_t note = static_cast<uint8_t>(36 + (i * 7 + t) % 48);
+			if (i % 8 == 0) builder.add(i * 120, std::make_shared<EventControlChange>(channel, 11, static_cast<uint8_t>(i % 128)));
+			builder.add(i * 120, std::make_shared<EventNoteOn>(channel, note, 100));
+			builder.add(i * 120 + 100, std::make_shared<EventNoteOff>(channel, note, 0));
+		}
+		smf.tracks.emplace_back(builder.build());
+	}
+
+	const auto serial = smf.getFileImage();
+	std::cout << tracks << " tracks, " << notes << " notes/track, " << serial.size() << " bytes, hardware threads " << std::thread::hardware_concurrency() << std::endl;
+
+	std::vector<size_t> threadCounts = { 1, 2, 4, 8 };
+	if (const size_t hw = std::thread::hardware_concurrency(); hw > 0 && std::find(threadCounts.begin(), threadCounts.end(), hw) == threadCounts.end()) {
+		threadCounts.push_back(hw);
+	}
+
+	double base = 0;
+	for (const auto threads : threadCounts) {
+		Smf::WriteOptions options;
+		options.threads = threads;
+
+		double best = (std::numeric_limits<double>::max)();
+		for (size_t i = 0; i < repeat; i++) {
+			const auto begin = std::chrono::steady_clock::now();
+			const auto image = smf.getFileImage(options);
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+			if (image != serial) {
+				std::cerr << "getFileImage output differs from serial (threads " << threads << ")" << std::endl;
+				return 1;
+			}
+			best = (std::min)(best, elapsed.count());
+		}
+
+		std::ostringstream os;
+		smf.write(os, options);
+		const auto written = os.str();
+		if (written.size() != serial.size() || !std::equal(written.begin(), written.end(), serial.begin(), [](char a, uint8_t b) { return static_cast<uint8_t>(a) == b; })) {
+			std::cerr << "write output differs from serial (threads " << threads << ")" << std::endl;
+			return 1;
+		}
+
+		if (threads == 1) base = best;
+		std::cout << "threads " << threads << ": " << best << " ms (best of " << repeat << "), x" << base / best << std::endl;
+	}
+	return 0;
+}
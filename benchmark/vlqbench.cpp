@@ -0,0 +1,162 @@
+﻿
+// 可変長数値(VLQ)の読み書きのマイクロベンチマーク
+// 以前の実装(std::function で1バイトずつ読み、ビットフィールドを入れ替える)と
+// utility::decodeVariableValue/writeVariableValue/encodeVariableValue を比べる
+// 値の分布は SMF のデルタタイムに近いもの(1バイト:60%, 2バイト:35%, 3～4バイト:5%)
+//	usage: vlqbench [値の数(既定:4000000)] [回数(既定:5)]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../sequencer/MidiEvent.h"
+
+// 以前の実装
+namespace legacy {
+#pragma pack( push )
+#pragma pack( 1 )
+	union VariableValue {
+		struct {
+			uint64_t	b0 : 7;
+			uint64_t	b1 : 7;
+			uint64_t	b2 : 7;
+			uint64_t	b3 : 7;
+			uint64_t	b4 : 7;
+			uint64_t	b5 : 7;
+			uint64_t	b6 : 7;
+			uint64_t	b7 : 7;
+			uint64_t	reserved : 8;
+		};
+		uint64_t	value = 0;
+	};
+	union VariableByte {
+		struct {
+			uint8_t	b7 : 7;
+			uint8_t	flag : 1;
+		};
+		uint8_t		value;
+
+		VariableByte(uint8_t val=0)
+			:value(val)
+		{}
+		VariableByte(uint8_t b7_, bool flag_)
+			:b7(b7_)
+			, flag(flag_)
+		{}
+	};
+#pragma pack( pop )
+
+	size_t getVariableValueSize(uint64_t n) {
+		size_t size = 1;
+		for (n >>= 7; n && size < 8; n >>= 7) size++;	// 最大8バイト(56bit)
+		return size;
+	}
+
+	uint8_t* writeVariableValue(uint64_t n, uint8_t* p) {
+		for (size_t i = getVariableValueSize(n) - 1; i > 0; i--) {
+			*p++ = VariableByte(static_cast<uint8_t>(n >> (7 * i) & 0x7f), true).value;
+		}
+		*p++ = VariableByte(static_cast<uint8_t>(n & 0x7f), false).value;
+		return p;
+	}
+
+	uint64_t readVariableValue(const std::function<uint8_t()>& fReadByte) {
+		VariableValue vv;
+		for (size_t i = 0; i < 8; i++) {	// failsafe
+			const VariableByte vb(fReadByte());
+			vv.b7 = vv.b6;
+			vv.b6 = vv.b5;
+			vv.b5 = vv.b4;
+			vv.b4 = vv.b3;
+			vv.b3 = vv.b2;
+			vv.b2 = vv.b1;
+			vv.b1 = vv.b0;
+			vv.b0 = vb.b7;
+			if (!vb.flag) return vv.value;
+		}
+		throw std::runtime_error("variable value error");
+	}
+}
+
+using namespace rlib::midi;
+
+int main(const int argc, const char* const argv[])
+{
+	const size_t count = argc > 1 ? std::stoul(argv[1]) : 4000000;
+	const size_t repeat = argc > 2 ? std::stoul(argv[2]) : 5;
+
+	std::vector<uint64_t> values(count);
+	std::mt19937 rng(1);
+	for (auto& v : values) {
+		const auto r = rng() % 100;
+		v = r < 60 ? rng() % 0x80 : r < 95 ? 0x80 + rng() % (0x4000 - 0x80) : 0x4000 + rng() % (0x0fffffff - 0x4000);
+	}
+
+	const auto measure = [&](const char* name, auto f) {
+		double best = (std::numeric_limits<double>::max)();
+		for (size_t i = 0; i < repeat; i++) {
+			const auto begin = std::chrono::steady_clock::now();
+			f();
+			const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+			best = (std::min)(best, elapsed.count());
+		}
+		std::cout << name << ": " << best / count << " ns/value (best of " << repeat << ")" << std::endl;
+	};
+
+	// 書き込み
+	std::vector<uint8_t> legacyBytes(count * 4), bytes(count * 4);
+	uint8_t* legacyEnd = nullptr;
+	uint8_t* end = nullptr;
+	measure("write legacy               ", [&] {
+		auto p = legacyBytes.data();
+		for (const auto v : values) p = legacy::writeVariableValue(v, p);
+		legacyEnd = p;
+	});
+	measure("write writeVariableValue   ", [&] {
+		auto p = bytes.data();
+		for (const auto v : values) p = utility::writeVariableValue(v, p);
+		end = p;
+	});
+	std::vector<uint8_t> scratchBytes(count * 4);
+	uint8_t* scratchEnd = nullptr;
+	measure("write encodeVariableValue  ", [&] {
+		auto p = scratchBytes.data();
+		for (const auto v : values) {
+			const auto vv = utility::encodeVariableValue(static_cast<uint32_t>(v));
+			p = std::copy_n(vv.bytes.data(), vv.size, p);
+		}
+		scratchEnd = p;
+	});
+	if (!std::equal(bytes.data(), end, legacyBytes.data(), legacyEnd) || !std::equal(scratchBytes.data(), scratchEnd, legacyBytes.data(), legacyEnd)) {
+		std::cerr << "encoded bytes differ" << std::endl;
+		return 1;
+	}
+
+	// 読み込み
+	std::vector<uint64_t> legacyDecoded(count), decoded(count);
+	measure("read  legacy(std::function)", [&] {
+		const uint8_t* p = legacyBytes.data();
+		const std::function<uint8_t()> readByte = [&] { return *p++; };
+		for (auto& v : legacyDecoded) v = legacy::readVariableValue(readByte);
+	});
+	measure("read  decodeVariableValue  ", [&] {
+		const uint8_t* p = bytes.data();
+		for (auto& v : decoded) {
+			const auto r = utility::decodeVariableValue(p, end);
+			v = r.value;
+			p += r.size;
+		}
+	});
+	if (legacyDecoded != values || decoded != values) {
+		std::cerr << "decoded values differ" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <bits/stdc++.h>
 #include <boost/program_options.hpp>
 
+#include "./batch/Batch.h"
 #include "./sequencer/MmlToSmf.h"
 
 using namespace rlib;
@@ -14,6 +15,8 @@ int main(const int argc, const char* const argv[])
 	try {
 		std::string input = "-", output = "-";
 		std::string format = "text";
+		size_t jobs = 0;
+		size_t threads = 1;
 		po::options_description desc("options");
 		desc.add_options()
 			("version", "show version")
@@ -24,8 +27,12 @@ int main(const int argc, const char* const argv[])
 					if (f != "text" && f != "json") throw po::validation_error(po::validation_error::invalid_option_value, "format", f);
 				}),
 				"output format: text (default) or json")
+			("running-status", "write with running status (smaller file)")
 			("input,i", po::value(&input), "input file (mml)")		// 入力ファイルパス(mml)
 			("output,o", po::value(&output), "output file (mid)")	// 出力ファイル(mid)
+			("batch", "batch mode: input is a directory or a list file, output is a directory. prints a JSON summary")
+			("jobs,j", po::value(&jobs)->default_value(0), "worker threads for batch mode (0: hardware concurrency)")
+			("threads", po::value(&threads)->default_value(1), "worker threads for compiling CreateSequence bodies (0: hardware concurrency)")
 			;
 
 		po::positional_options_description pd;
@@ -46,6 +53,28 @@ int main(const int argc, const char* const argv[])
 
 		po::notify(vm);
 
+		midi::Smf::WriteOptions writeOptions;
+		MmlCompiler::Options compileOptions;
+		compileOptions.threads = threads;
+		writeOptions.runningStatus = vm.count("running-status") > 0;
+
+		if (vm.count("batch")) {		// バッチ変換
+			if (input == "-" || output == "-") throw std::runtime_error("batch mode requires input and output.");
+			const auto items = batch::listInputs(input, { ".mml" });
+			const auto summary = batch::run(items, jobs, [&](const batch::Item& item, std::ostream&) {
+				std::ifstream fs(item.input, std::ios::in | std::ios::binary);
+				if (fs.fail()) throw std::runtime_error("input file open error.");
+				const auto r = mmlToSmf(std::string(std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>()), compileOptions);
+				if (r.hasError()) throw std::runtime_error(r.mmlResult.getText(r.mmlResult.errors));
+
+				std::ofstream os(batch::outputPath(output, item, ".mid"), std::ios::out | std::ios::binary | std::ios::trunc);
+				if (os.fail()) throw std::runtime_error("output file open error.");
+				r.smf.write(os, writeOptions);
+			});
+			std::cout << summary << std::endl;
+			return summary["failed"].get<size_t>() > 0 ? 1 : 0;
+		}
+
 		const std::string mml = [&] {
 			if (input != "-") {
 				auto path = std::filesystem::path(input);
@@ -57,20 +86,19 @@ int main(const int argc, const char* const argv[])
 			return std::string(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());	// stdin
 		}();
 
-		const auto r = mmlToSmf(mml);
+		const auto r = mmlToSmf(mml, compileOptions);
 		if (r.hasError()) {
 			const auto err = format == "json" ? r.mmlResult.getJson(r.mmlResult.errors) : r.mmlResult.getText(r.mmlResult.errors);
 			std::cerr << err << std::endl;
 			return 1;
 		}
-		const auto fileImage = r.smf.getFileImage();
 		if (output != "-") {
 			auto path = std::filesystem::path(output);
 			std::ofstream fs(path, std::ios::out | std::ios::binary | std::ios::trunc);
 			if (fs.fail()) throw std::runtime_error("output file open error.");
-			fs.write(reinterpret_cast<const char*>(fileImage.data()), fileImage.size());
+			r.smf.write(fs, writeOptions);
 		} else {
-			std::cout.write(reinterpret_cast<const char*>(fileImage.data()), fileImage.size());	// stdout
+			r.smf.write(std::cout, writeOptions);	// stdout
 		}
 
 	} catch (std::exception& e) {
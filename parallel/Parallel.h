@@ -0,0 +1,59 @@
+﻿// rlib parallel
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rlib::parallel {
+
+	// スレッド数の解決 (0:ハードウェアのスレッド数)
+	inline size_t resolveThreads(size_t threads) {
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+		return 1;		// pthread 無効のビルドではスレッドを作れない
+#else
+		if (threads == 0) threads = std::thread::hardware_concurrency();
+		return (std::max<size_t>)(threads, 1);
+#endif
+	}
+
+	// f(index) を index = 0 ～ count-1 について threads 個のスレッドで実行する
+	// 各スレッドは未処理の index を若い順に取り出して処理する(重い要素があっても偏らない)
+	// 例外が発生した場合は残りの index の処理を打ち切り、最初の例外を呼び出し元へ再送出する
+	template <typename F> void forEach(size_t count, size_t threads, F&& f) {
+		threads = (std::min)(resolveThreads(threads), count);
+		if (threads <= 1) {
+			for (size_t i = 0; i < count; i++) f(i);
+			return;
+		}
+
+		std::atomic<size_t> next = 0;
+		std::mutex mutex;
+		std::exception_ptr ep;
+		const auto worker = [&] {
+			for (size_t i; (i = next++) < count;) {
+				try {
+					f(i);
+				} catch (...) {
+					std::lock_guard lock(mutex);
+					if (!ep) ep = std::current_exception();
+					next = count;		// 残りは打ち切り
+				}
+			}
+		};
+
+		std::vector<std::thread> workers;
+		workers.reserve(threads - 1);
+		for (size_t i = 1; i < threads; i++) {
+			workers.emplace_back(worker);
+		}
+		worker();	// 呼び出し元スレッドも処理に参加
+		for (auto& t : workers) t.join();
+		if (ep) std::rethrow_exception(ep);
+	}
+
+}
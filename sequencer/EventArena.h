@@ -0,0 +1,100 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+
+namespace rlib::midi {
+
+	// イベント用のメモリアリーナ
+	// 確保したメモリは個別には解放せず、EventArena の破棄時にまとめて解放する
+	// スレッドセーフではない(スレッド毎に別の EventArena を使うこと)
+	class EventArena {
+	public:
+		explicit EventArena(size_t initialSize = 16 * 1024)
+			:m_resource(initialSize, &m_upstream)
+		{}
+		EventArena(const EventArena&) = delete;
+		EventArena& operator=(const EventArena&) = delete;
+
+		void* allocate(size_t bytes, size_t alignment) {
+			m_used += bytes;
+			return m_resource.allocate(bytes, alignment);
+		}
+
+		size_t used() const {		// 確保要求されたバイト数の合計
+			return m_used;
+		}
+		size_t size() const {		// ヒープから確保したバイト数(アリーナの大きさ)
+			return m_upstream.size;
+		}
+
+	private:
+		// ヒープから確保したバイト数を数える
+		struct Upstream : public std::pmr::memory_resource {
+			size_t	size = 0;
+			void* do_allocate(size_t bytes, size_t alignment) override {
+				void* p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+				size += bytes;
+				return p;
+			}
+			void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+				std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+			}
+			bool do_is_equal(const std::pmr::memory_resource& b) const noexcept override {
+				return this == &b;
+			}
+		};
+		Upstream							m_upstream;
+		std::pmr::monotonic_buffer_resource	m_resource;
+		size_t								m_used = 0;
+	};
+
+	// EventArena から確保するアロケータ(arena が nullptr ならヒープから確保する)
+	// アリーナは shared_ptr で保持するので、確保したオブジェクトやコンテナが残っている間は解放されない
+	template <typename T> class ArenaAllocator {
+	public:
+		using value_type = T;
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap = std::true_type;
+
+		ArenaAllocator() noexcept {}
+		explicit ArenaAllocator(std::shared_ptr<EventArena> arena) noexcept
+			:m_arena(std::move(arena))
+		{}
+		template <typename U> ArenaAllocator(const ArenaAllocator<U>& b) noexcept
+			:m_arena(b.arena())
+		{}
+
+		T* allocate(size_t n) {
+			if (!m_arena) return std::allocator<T>().allocate(n);
+			return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+		}
+		void deallocate(T* p, size_t n) noexcept {
+			if (!m_arena) std::allocator<T>().deallocate(p, n);	// アリーナなら破棄時にまとめて解放
+		}
+
+		const std::shared_ptr<EventArena>& arena() const noexcept {
+			return m_arena;
+		}
+		template <typename U> bool operator==(const ArenaAllocator<U>& b) const noexcept {
+			return m_arena == b.arena();
+		}
+	private:
+		std::shared_ptr<EventArena>	m_arena;
+	};
+
+	// アリーナに確保できる multimap
+	template <typename Key, typename T> using ArenaMultimap = std::multimap<Key, T, std::less<Key>, ArenaAllocator<std::pair<const Key, T>>>;
+
+	// arena に T を生成する(arena が nullptr なら std::make_shared と同じ)
+	template <typename T, typename... Args> std::shared_ptr<T> allocateShared(const std::shared_ptr<EventArena>& arena, Args&&... args) {
+		if (!arena) return std::make_shared<T>(std::forward<Args>(args)...);
+		return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+	}
+
+}
@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "MidiEvent.h"
+
+namespace rlib::midi {
+
+	// 同じ内容のチャンネルメッセージの Event を1つのインスタンスで共有する(フライウェイト)
+	// 曲中で何度も現れる同じ NoteOn/NoteOff や ControlChange を毎回生成しない
+	// SysEx/メタイベントは共有せず毎回生成する
+	// スレッドセーフではない
+	class EventInterner {
+	public:
+		explicit EventInterner(std::shared_ptr<EventArena> arena = nullptr, bool enabled = true)	// enabled が false なら常に生成する
+			:m_arena(std::move(arena))
+			, m_enabled(enabled)
+		{}
+
+		std::shared_ptr<const Event> get(const ChannelMessage& m) {
+			const Message message = std::visit([](const auto& m)->Message {return m; }, m);
+			if (!m_enabled) return makeEvent(message, m_arena);
+			uint8_t bytes[3] = {};
+			encode(message, bytes);
+			auto& event = slot(key(bytes[0], bytes[1], bytes[2]));
+			if (event) {
+				m_shared++;
+			} else {
+				event = makeEvent(message, m_arena);
+			}
+			return event;
+		}
+
+		std::shared_ptr<const Event> get(const EventView& view) {
+			if (!m_enabled || !view.isChannelMessage()) return view.toEvent(m_arena);
+			auto& event = slot(key(view.status, view.value(0), view.data.size() > 1 ? view.value(1) : 0));
+			if (event) {
+				m_shared++;
+			} else {
+				event = view.toEvent(m_arena);
+			}
+			return event;
+		}
+
+		const std::shared_ptr<EventArena>& arena() const {
+			return m_arena;
+		}
+		size_t size() const {		// 共有しているインスタンスの数
+			return m_size;
+		}
+		size_t shared() const {		// 生成せずに共有で済ませた回数
+			return m_shared;
+		}
+
+	private:
+		static uint32_t key(uint8_t status, uint8_t data1, uint8_t data2) {
+			return static_cast<uint32_t>(status) << 16 | static_cast<uint32_t>(data1) << 8 | data2;
+		}
+
+		// key の Event を入れる場所(無ければ空の場所を確保する)
+		// 開番地法のハッシュ表。キーはステータスを含むので0にはならず、0を空きの印にする
+		std::shared_ptr<const Event>& slot(uint32_t key) {
+			if ((m_size + 1) * 2 > m_slots.size()) grow();
+			const size_t mask = m_slots.size() - 1;
+			for (size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+				auto& s = m_slots[i];
+				if (s.first == key) return s.second;
+				if (s.first == 0) {
+					s.first = key;
+					m_size++;
+					return s.second;
+				}
+			}
+		}
+		void grow() {
+			std::vector<std::pair<uint32_t, std::shared_ptr<const Event>>> slots((std::max<size_t>)(m_slots.size() * 2, 256));
+			const size_t mask = slots.size() - 1;
+			for (auto& s : m_slots) {
+				if (s.first == 0) continue;
+				size_t i = hash(s.first) & mask;
+				while (slots[i].first != 0) i = (i + 1) & mask;
+				slots[i] = std::move(s);
+			}
+			m_slots.swap(slots);
+		}
+		static size_t hash(uint32_t key) {
+			return static_cast<size_t>(key * 0x9e3779b1u >> 8);
+		}
+
+		std::shared_ptr<EventArena>	m_arena;
+		bool						m_enabled = true;
+		std::vector<std::pair<uint32_t, std::shared_ptr<const Event>>>	m_slots;	// <ステータス+データ,Event>(空きは0)
+		size_t						m_size = 0;
+		size_t						m_shared = 0;
+	};
+
+}
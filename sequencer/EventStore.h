@@ -0,0 +1,187 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "MidiEvent.h"
+
+namespace rlib::midi {
+
+	// トラックのイベントを位置順に連続領域で保持するコンテナ
+	// std::multimap<size_t, std::shared_ptr<const Event>> と同じ順序(位置順、同じ位置は追加順)を保つ
+	// チャンネルメッセージは要素に直接、SysEx/メタのデータは別のバイト列にまとめて持つ
+	// 取り出すのは EventView なので、要素を追加すると以前に取得した EventView は無効になる
+	class EventStore {
+	public:
+		using EventMap = ArenaMultimap<size_t, std::shared_ptr<const Event>>;	// Smf::Events と同じ型
+
+		struct Item {
+			size_t		position;	// 絶対位置(tick)
+			EventView	event;
+		};
+
+		class const_iterator {
+		public:
+			using value_type = Item;
+			using difference_type = std::ptrdiff_t;
+			using iterator_category = std::bidirectional_iterator_tag;
+
+			const_iterator() {}
+			const_iterator(const EventStore* store, size_t index)
+				:m_store(store)
+				, m_index(index)
+			{}
+			Item operator*() const {
+				return (*m_store)[m_index];
+			}
+			const_iterator& operator++() {
+				m_index++;
+				return *this;
+			}
+			const_iterator operator++(int) {
+				auto i = *this;
+				m_index++;
+				return i;
+			}
+			const_iterator& operator--() {
+				m_index--;
+				return *this;
+			}
+			const_iterator operator--(int) {
+				auto i = *this;
+				m_index--;
+				return i;
+			}
+			bool operator==(const const_iterator& b) const {
+				return m_index == b.m_index;
+			}
+			size_t index() const {
+				return m_index;
+			}
+		private:
+			const EventStore*	m_store = nullptr;
+			size_t				m_index = 0;
+		};
+
+	private:
+#pragma pack( push )
+#pragma pack( 4 )
+		struct Entry {
+			size_t		position = 0;
+			uint32_t	offset = 0;		// SysEx/メタ: m_payload 内の位置
+			uint32_t	size = 0;		// SysEx/メタ: データ長, チャンネルメッセージ: データバイト数
+			uint8_t		status = 0;
+			uint8_t		metaType = 0;
+			std::array<uint8_t, 2>	data{};	// チャンネルメッセージのデータバイト
+		};
+#pragma pack( pop )
+
+		std::vector<Entry>		m_entries;
+		std::vector<uint8_t>	m_payload;		// SysEx/メタのデータ
+
+		Entry makeEntry(size_t position, const EventView& event) {
+			Entry e;
+			e.position = position;
+			e.status = event.status;
+			e.metaType = event.metaType;
+			e.size = static_cast<uint32_t>(event.data.size());
+			if (event.isChannelMessage()) {
+				std::copy_n(event.data.begin(), (std::min<size_t>)(event.data.size(), e.data.size()), e.data.begin());
+			} else {
+				e.offset = static_cast<uint32_t>(m_payload.size());
+				m_payload.insert(m_payload.end(), event.data.begin(), event.data.end());
+			}
+			return e;
+		}
+
+	public:
+		EventStore() {}
+
+		size_t size() const {
+			return m_entries.size();
+		}
+		bool empty() const {
+			return m_entries.empty();
+		}
+		void clear() {
+			m_entries.clear();
+			m_payload.clear();
+		}
+		void reserve(size_t events, size_t payloadBytes = 0) {
+			m_entries.reserve(events);
+			m_payload.reserve(payloadBytes);
+		}
+
+		Item operator[](size_t index) const {
+			const auto& e = m_entries[index];
+			EventView view{ e.status, e.metaType };
+			view.data = e.status < 0xf0 ? std::span<const uint8_t>(e.data.data(), e.size) : std::span<const uint8_t>(m_payload.data() + e.offset, e.size);
+			return { e.position, view };
+		}
+
+		const_iterator begin() const {
+			return const_iterator(this, 0);
+		}
+		const_iterator end() const {
+			return const_iterator(this, m_entries.size());
+		}
+
+		// position 以上の最初の要素
+		const_iterator lower_bound(size_t position) const {
+			const auto i = std::partition_point(m_entries.begin(), m_entries.end(), [position](const Entry& e) {return e.position < position; });
+			return const_iterator(this, i - m_entries.begin());
+		}
+		// position より後の最初の要素
+		const_iterator upper_bound(size_t position) const {
+			const auto i = std::partition_point(m_entries.begin(), m_entries.end(), [position](const Entry& e) {return e.position <= position; });
+			return const_iterator(this, i - m_entries.begin());
+		}
+
+		// 追加(同じ位置のイベントの後ろへ)。位置が末尾以降なら O(1)
+		const_iterator insert(size_t position, const EventView& event) {
+			auto entry = makeEntry(position, event);
+			if (m_entries.empty() || m_entries.back().position <= position) {
+				m_entries.push_back(entry);
+				return const_iterator(this, m_entries.size() - 1);
+			}
+			const auto i = m_entries.begin() + upper_bound(position).index();
+			return const_iterator(this, m_entries.insert(i, entry) - m_entries.begin());
+		}
+		const_iterator insert(size_t position, const Event& event) {
+			std::array<uint8_t, 32> small;
+			std::vector<uint8_t> large;
+			const size_t size = event.encodedSize();
+			uint8_t* p = small.data();
+			if (size > small.size()) {
+				large.resize(size);
+				p = large.data();
+			}
+			event.encode(p);
+			return insert(position, EventView::fromEncoded({ p, size }));
+		}
+
+		// multimap との変換(移行用)
+		static EventStore fromEvents(const EventMap& events) {
+			EventStore store;
+			store.reserve(events.size());
+			for (const auto& [position, event] : events) {
+				store.insert(position, *event);
+			}
+			return store;
+		}
+		EventMap toEvents(const std::shared_ptr<EventArena>& arena = nullptr) const {	// arena を指定するとそこに確保する
+			EventMap events{ EventMap::allocator_type(arena) };
+			for (const auto& [position, event] : *this) {
+				events.emplace_hint(events.end(), position, event.toEvent(arena));
+			}
+			return events;
+		}
+	};
+
+}
@@ -1,44 +1,26 @@
 ﻿#pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
-#include <vector>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "EventArena.h"
+#include "Payload.h"
 
 namespace rlib::midi {
 
 	namespace utility {
 #pragma pack( push )
 #pragma pack( 1 )
-		union VariableValue {
-			struct {
-				uint64_t	b0 : 7;
-				uint64_t	b1 : 7;
-				uint64_t	b2 : 7;
-				uint64_t	b3 : 7;
-				uint64_t	b4 : 7;
-				uint64_t	b5 : 7;
-				uint64_t	b6 : 7;
-				uint64_t	b7 : 7;
-				uint64_t	reserved : 8;
-			};
-			uint64_t	value = 0;
-		};
-		union VariableByte {
-			struct {
-				uint8_t	b7 : 7;
-				uint8_t	flag : 1;
-			};
-			uint8_t		value;
-
-			VariableByte(uint8_t val=0)
-				:value(val)
-			{}
-			VariableByte(uint8_t b7_, bool flag_)
-				:b7(b7_)
-				, flag(flag_)
-			{}
-		};
-
 		union Bit14 {
 			uint16_t value = 0;
 			struct {
@@ -49,45 +31,121 @@ namespace rlib::midi {
 		}; 
 #pragma pack( pop )
 
-		// 可変長数値作成
-		static std::vector<uint8_t> getVariableValue(uint64_t n) {
-			std::vector<uint8_t> v;
-			VariableValue vv;
-			vv.value = n;
-			if (vv.b7) v.push_back(VariableByte(vv.b7, true).value);
-			if (vv.b6 || !v.empty()) v.push_back(VariableByte(vv.b6, true).value);
-			if (vv.b5 || !v.empty()) v.push_back(VariableByte(vv.b5, true).value);
-			if (vv.b4 || !v.empty()) v.push_back(VariableByte(vv.b4, true).value);
-			if (vv.b3 || !v.empty()) v.push_back(VariableByte(vv.b3, true).value);
-			if (vv.b2 || !v.empty()) v.push_back(VariableByte(vv.b2, true).value);
-			if (vv.b1 || !v.empty()) v.push_back(VariableByte(vv.b1, true).value);
-			v.push_back(VariableByte(vv.b0, false).value);
-			return v;
+		// 可変長数値のバイト数
+		static size_t getVariableValueSize(uint64_t n) {
+			return std::clamp<size_t>((std::bit_width(n) + 6) / 7, 1, 8);	// 7bit毎に1バイト、最大8バイト(56bit)
 		}
 
-		// 可変長数値から値を取得
-		static uint64_t readVariableValue(const std::function<uint8_t()>& fReadByte) {
-			utility::VariableValue vv;
+		// 可変長数値書き込み(戻り値:書き込んだ次の位置)
+		static uint8_t* writeVariableValue(uint64_t n, uint8_t* p) {
+			if (n < 0x80) {							// 1バイト
+				*p++ = static_cast<uint8_t>(n);
+				return p;
+			}
+			if (n < 0x4000) {						// 2バイト
+				*p++ = static_cast<uint8_t>(0x80 | n >> 7);
+				*p++ = static_cast<uint8_t>(n & 0x7f);
+				return p;
+			}
+			for (size_t i = getVariableValueSize(n) - 1; i > 0; i--) {
+				*p++ = static_cast<uint8_t>(0x80 | (n >> (7 * i) & 0x7f));
+			}
+			*p++ = static_cast<uint8_t>(n & 0x7f);
+			return p;
+		}
+
+		// SMF の範囲(4バイト以内)の可変長数値
+		struct VariableValueBytes {
+			std::array<uint8_t, 4>	bytes{};
+			uint8_t					size = 0;
+
+			std::span<const uint8_t> span() const {
+				return { bytes.data(), size };
+			}
+		};
+
+		// 可変長数値を4バイトの作業領域へ書き込む(SMF の上限 0x0fffffff まで)
+		inline VariableValueBytes encodeVariableValue(uint32_t n) {
+			assert(n <= 0x0fffffff);
+			VariableValueBytes result;
+			result.size = static_cast<uint8_t>(writeVariableValue(n & 0x0fffffff, result.bytes.data()) - result.bytes.data());
+			return result;
+		}
+
+		// 可変長数値のデコード結果
+		struct DecodedVariableValue {
+			uint64_t	value = 0;
+			size_t		size = 0;		// 読んだバイト数(0:データが途中で終わっている)
+		};
+
+		// [p, end) の先頭から可変長数値を取得
+		static DecodedVariableValue decodeVariableValue(const uint8_t* p, const uint8_t* end) {
+			const size_t remain = end - p;
+			if (remain >= 1 && !(p[0] & 0x80)) return { p[0], 1 };									// 1バイト
+			if (remain >= 2 && !(p[1] & 0x80)) return { (uint64_t(p[0] & 0x7f) << 7) | p[1], 2 };		// 2バイト
+			uint64_t value = 0;
 			for (size_t i = 0; i < 8; i++) {	// failsafe
-				const VariableByte vb(fReadByte());
-				vv.b7 = vv.b6;
-				vv.b6 = vv.b5;
-				vv.b5 = vv.b4;
-				vv.b4 = vv.b3;
-				vv.b3 = vv.b2;
-				vv.b2 = vv.b1;
-				vv.b1 = vv.b0;
-				vv.b0 = vb.b7;
-				if (!vb.flag) return vv.value;
+				if (i >= remain) return {};
+				value = (value << 7) | (p[i] & 0x7f);
+				if (!(p[i] & 0x80)) return { value, i + 1 };
 			}
 			throw std::runtime_error("variable value error");
-		};
+		}
+
+	}
+
+	struct EventNoteOff;
+	struct EventNoteOn;
+	struct EventPolyphonicKeyPressure;
+	struct EventControlChange;
+	struct EventProgramChange;
+	struct EventPitchBend;
+	struct EventChannelPressure;
+	struct EventSystemExclusive;
+	struct EventMeta;
 
+	// 具象イベントへの参照(RTTI を使わずに std::visit で振り分けるため)
+	using EventRef = std::variant<
+		const EventNoteOff*,
+		const EventNoteOn*,
+		const EventPolyphonicKeyPressure*,
+		const EventControlChange*,
+		const EventProgramChange*,
+		const EventPitchBend*,
+		const EventChannelPressure*,
+		const EventSystemExclusive*,
+		const EventMeta*
+	>;
+
+	namespace utility {
+		// std::visit 用に複数のラムダをまとめる
+		template <typename... Ts> struct Overloaded : Ts... {
+			using Ts::operator()...;
+		};
+		template <typename... Ts> Overloaded(Ts...) -> Overloaded<Ts...>;
 	}
 
 	struct Event {
 		virtual ~Event() {}
-		virtual std::vector<uint8_t> smfBytes() const = 0;
+		virtual EventRef ref() const = 0;					// 具象イベントへの参照
+		virtual size_t encodedSize() const = 0;				// SMFデータのバイト数
+		virtual uint8_t* encode(uint8_t* p) const = 0;		// SMFデータを p へ書き込む(encodedSize()分。戻り値:書き込んだ次の位置)
+
+		// 具象イベントの型で f を呼ぶ(f(const EventNoteOn&) 等)
+		template <typename F> decltype(auto) visit(F&& f) const {
+			return std::visit([&f](const auto* p) -> decltype(auto) {return f(*p); }, ref());
+		}
+		template <typename T> const T* as() const {		// 型が T なら参照を返す(dynamic_cast の代わり)
+			const auto r = ref();
+			const auto p = std::get_if<const T*>(&r);
+			return p ? *p : nullptr;
+		}
+
+		std::vector<uint8_t> smfBytes() const {
+			std::vector<uint8_t> v(encodedSize());
+			encode(v.data());
+			return v;
+		}
 	};
 
 	struct EventCh : public Event {
@@ -112,8 +170,17 @@ namespace rlib::midi {
 		EventNoteOff(uint8_t channel, uint8_t note, uint8_t velocity)
 			:EventNote(channel, note, velocity)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (channel & 0xf)), static_cast<uint8_t>(note & 0x7f), static_cast<uint8_t>(velocity & 0x7f)};
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 3;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(note & 0x7f);
+			*p++ = static_cast<uint8_t>(velocity & 0x7f);
+			return p;
 		}
 	};
 
@@ -122,8 +189,17 @@ namespace rlib::midi {
 		EventNoteOn(uint8_t channel, uint8_t note, uint8_t velocity)
 			:EventNote(channel, note, velocity)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (channel & 0xf)), static_cast<uint8_t>(note & 0x7f), static_cast<uint8_t>(velocity & 0x7f)};
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 3;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(note & 0x7f);
+			*p++ = static_cast<uint8_t>(velocity & 0x7f);
+			return p;
 		}
 	};
 
@@ -134,8 +210,17 @@ namespace rlib::midi {
 		EventPolyphonicKeyPressure(uint8_t channel, uint8_t note_, uint8_t pressure_)
 			:EventCh(channel), note(note_), pressure(pressure_)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (note & 0xf)), static_cast<uint8_t>(pressure & 0x7f)};
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 3;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(note & 0x7f);
+			*p++ = static_cast<uint8_t>(pressure & 0x7f);
+			return p;
 		}
 	};
 
@@ -169,8 +254,17 @@ namespace rlib::midi {
 		EventControlChange(uint8_t channel, uint8_t type_, uint8_t value_)
 			:EventCh(channel), type(static_cast<Type>(type_)), value(value_)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (channel & 0xf)), static_cast<uint8_t>(static_cast<uint8_t>(type) & 0x7f), static_cast<uint8_t>(value & 0x7f)};
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 3;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(static_cast<uint8_t>(type) & 0x7f);
+			*p++ = static_cast<uint8_t>(value & 0x7f);
+			return p;
 		}
 	};
 
@@ -180,8 +274,16 @@ namespace rlib::midi {
 		EventProgramChange(uint8_t channel, uint8_t programNo_)
 			:EventCh(channel), programNo(programNo_)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (channel & 0xf)), static_cast<uint8_t>(programNo & 0x7f)};
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 2;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(programNo & 0x7f);
+			return p;
 		}
 	};
 
@@ -191,9 +293,18 @@ namespace rlib::midi {
 		EventPitchBend(uint8_t channel, int16_t pitchBend_)
 			:EventCh(channel), pitchBend(pitchBend_)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 3;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
 			const int n = pitchBend + 8192;
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (channel & 0xf)), static_cast<uint8_t>(n & 0x7f), static_cast<uint8_t>(n / 0x80 & 0x7f)};
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(n & 0x7f);
+			*p++ = static_cast<uint8_t>(n / 0x80 & 0x7f);
+			return p;
 		}
 	};
 
@@ -203,28 +314,38 @@ namespace rlib::midi {
 		EventChannelPressure(uint8_t channel, uint8_t channelPressure_)
 			:EventCh(channel), channelPressure(channelPressure_)
 		{}
-		virtual std::vector<uint8_t> smfBytes() const {
-			return std::vector<uint8_t>{static_cast<uint8_t>(statusByte | (channel & 0xf)), static_cast<uint8_t>(channelPressure & 0x7f)};
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 2;
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = static_cast<uint8_t>(statusByte | (channel & 0xf));
+			*p++ = static_cast<uint8_t>(channelPressure & 0x7f);
+			return p;
 		}
 	};
 
 	struct EventSystemExclusive : public Event {
 		static constexpr uint8_t statusByteF0 = 0xf0;
 		static constexpr uint8_t statusByteF7 = 0xf7;
-		const std::vector<uint8_t>	data;		// データ(先頭バイトは0xf0|0xf7)、末尾のf7は必須ではない
-		EventSystemExclusive(const std::vector<uint8_t>& data_)
-			:Event(), data(data_)
+		const Payload	data;		// データ(先頭バイトは0xf0|0xf7)、末尾のf7は必須ではない
+		EventSystemExclusive(Payload data_)
+			:Event(), data(std::move(data_))
 		{
 			assert(data.size() > 0 && (data[0] == statusByteF0 || data[0] == statusByteF7));
 		}
-		virtual std::vector<uint8_t> smfBytes() const {
-			std::vector<uint8_t> v{ data[0] };
-			{// データサイズ
-				std::vector<uint8_t> s = utility::getVariableValue(data.size() - 1);		// -1:statusByteは除く
-				v.insert(v.end(), std::make_move_iterator(s.begin()), std::make_move_iterator(s.end()));
-			}
-			v.insert(v.end(), data.begin() + 1, data.end());
-			return v;
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return data.size() + utility::getVariableValueSize(data.size() - 1);	// -1:statusByteは除く
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = data[0];
+			p = utility::writeVariableValue(data.size() - 1, p);				// データサイズ(-1:statusByteは除く)
+			return data.copyTo(p, 1);
 		}
 	};
 
@@ -247,10 +368,10 @@ namespace rlib::midi {
 			keySignature = 0x59,	// 調号
 			sequencerLocal = 0x7f,
 		};
-		const Type					type = Type::sequenceNo;
-		const std::vector<uint8_t>	data;
+		const Type		type = Type::sequenceNo;
+		const Payload	data;
 
-		EventMeta(Type type_, std::vector<uint8_t>&& data_)
+		EventMeta(Type type_, Payload data_)
 			:Event()
 			, type(type_)
 			, data(std::move(data_))
@@ -258,20 +379,20 @@ namespace rlib::midi {
 		EventMeta(Type type_, const std::string& s)
 			:Event()
 			, type(type_)
-			, data(std::vector<uint8_t>{ s.begin(), s.end() })
+			, data(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(s.data()), s.size()))
 		{}
 
-		virtual std::vector<uint8_t> smfBytes() const {
-			std::vector<uint8_t> v{
-				statusByte,
-				static_cast<uint8_t>(type),
-			};
-			{// データサイズ
-				std::vector<uint8_t> s = utility::getVariableValue(data.size());
-				v.insert(v.end(), std::make_move_iterator(s.begin()), std::make_move_iterator(s.end()));
-			}
-			v.insert(v.end(), data.begin(), data.end());	// データ
-			return v;
+		virtual EventRef ref() const {
+			return this;
+		}
+		virtual size_t encodedSize() const {
+			return 2 + utility::getVariableValueSize(data.size()) + data.size();
+		}
+		virtual uint8_t* encode(uint8_t* p) const {
+			*p++ = statusByte;
+			*p++ = static_cast<uint8_t>(type);
+			p = utility::writeVariableValue(data.size(), p);		// データサイズ
+			return data.copyTo(p);									// データ
 		}
 
 		double getTempo()const {
@@ -288,8 +409,8 @@ namespace rlib::midi {
 		}
 
 		std::string getText()const {
-			std::string s;
-			std::copy(data.begin(), data.end(), std::back_inserter(s));
+			std::string s(data.size(), '\0');
+			data.copyTo(reinterpret_cast<uint8_t*>(s.data()));
 			return s;
 		}
 
@@ -308,7 +429,7 @@ namespace rlib::midi {
 			assert(sizeof(t) == 4);
 			t.tempo = static_cast<uint32_t>(60000000.0 / tempo);		// 4分音符の時間(microsec)
 			std::reverse(reinterpret_cast<uint8_t*>(&t.tempo), reinterpret_cast<uint8_t*>(&t.tempo) + sizeof(t.tempo));		// エンディアン変更
-			return EventMeta(Type::tempo, std::vector<uint8_t>{ t.buf[1], t.buf[2], t.buf[3] });
+			return EventMeta(Type::tempo, Payload{ t.buf[1], t.buf[2], t.buf[3] });
 		}
 
 		static EventMeta createEndOfTrack() {
@@ -316,4 +437,238 @@ namespace rlib::midi {
 		}
 	};
 
+	// 値型の MIDI メッセージ(Event を確保せずに内容を表す。EventInterner の検索と Event との相互変換に使う)
+	// トラック等に保持するのは Event(shared_ptr)で、Message のまま格納している所はない
+	namespace message {
+		struct NoteOff {
+			uint8_t	channel = 0;
+			uint8_t	note = 0;
+			uint8_t	velocity = 0;
+		};
+		struct NoteOn {
+			uint8_t	channel = 0;
+			uint8_t	note = 0;
+			uint8_t	velocity = 0;
+		};
+		struct PolyphonicKeyPressure {
+			uint8_t	channel = 0;
+			uint8_t	note = 0;
+			uint8_t	pressure = 0;
+		};
+		struct ControlChange {
+			uint8_t	channel = 0;
+			uint8_t	type = 0;		// EventControlChange::Type
+			uint8_t	value = 0;
+		};
+		struct ProgramChange {
+			uint8_t	channel = 0;
+			uint8_t	programNo = 0;
+		};
+		struct PitchBend {
+			uint8_t	channel = 0;
+			int16_t	pitchBend = 0;	// -8192 ～ 8191
+		};
+		struct ChannelPressure {
+			uint8_t	channel = 0;
+			uint8_t	channelPressure = 0;
+		};
+		struct SystemExclusive {
+			Payload		data;	// 先頭バイトは0xf0|0xf7
+		};
+		struct Meta {
+			EventMeta::Type		type = EventMeta::Type::sequenceNo;
+			Payload				data;
+		};
+	}
+
+	// チャンネルメッセージ(8Byte以内の値型)
+	using ChannelMessage = std::variant<
+		message::NoteOff,
+		message::NoteOn,
+		message::PolyphonicKeyPressure,
+		message::ControlChange,
+		message::ProgramChange,
+		message::PitchBend,
+		message::ChannelPressure
+	>;
+	static_assert(sizeof(ChannelMessage) <= 8);
+
+	using Message = std::variant<
+		message::NoteOff,
+		message::NoteOn,
+		message::PolyphonicKeyPressure,
+		message::ControlChange,
+		message::ProgramChange,
+		message::PitchBend,
+		message::ChannelPressure,
+		message::SystemExclusive,
+		message::Meta
+	>;
+
+	// Event → Message
+	inline Message toMessage(const Event& event) {
+		return event.visit(utility::Overloaded{
+			[](const EventNoteOff& e)->Message { return message::NoteOff{ e.channel, e.note, e.velocity }; },
+			[](const EventNoteOn& e)->Message { return message::NoteOn{ e.channel, e.note, e.velocity }; },
+			[](const EventPolyphonicKeyPressure& e)->Message { return message::PolyphonicKeyPressure{ e.channel, e.note, e.pressure }; },
+			[](const EventControlChange& e)->Message { return message::ControlChange{ e.channel, static_cast<uint8_t>(e.type), e.value }; },
+			[](const EventProgramChange& e)->Message { return message::ProgramChange{ e.channel, e.programNo }; },
+			[](const EventPitchBend& e)->Message { return message::PitchBend{ e.channel, e.pitchBend }; },
+			[](const EventChannelPressure& e)->Message { return message::ChannelPressure{ e.channel, e.channelPressure }; },
+			[](const EventSystemExclusive& e)->Message { return message::SystemExclusive{ e.data }; },
+			[](const EventMeta& e)->Message { return message::Meta{ e.type, e.data }; },
+		});
+	}
+
+	// Message → Event(arena を指定するとそこに確保する)
+	inline std::shared_ptr<const Event> makeEvent(const Message& m, const std::shared_ptr<EventArena>& arena = nullptr) {
+		return std::visit(utility::Overloaded{
+			[&arena](const message::NoteOff& m)->std::shared_ptr<const Event> { return allocateShared<EventNoteOff>(arena, m.channel, m.note, m.velocity); },
+			[&arena](const message::NoteOn& m)->std::shared_ptr<const Event> { return allocateShared<EventNoteOn>(arena, m.channel, m.note, m.velocity); },
+			[&arena](const message::PolyphonicKeyPressure& m)->std::shared_ptr<const Event> { return allocateShared<EventPolyphonicKeyPressure>(arena, m.channel, m.note, m.pressure); },
+			[&arena](const message::ControlChange& m)->std::shared_ptr<const Event> { return allocateShared<EventControlChange>(arena, m.channel, m.type, m.value); },
+			[&arena](const message::ProgramChange& m)->std::shared_ptr<const Event> { return allocateShared<EventProgramChange>(arena, m.channel, m.programNo); },
+			[&arena](const message::PitchBend& m)->std::shared_ptr<const Event> { return allocateShared<EventPitchBend>(arena, m.channel, m.pitchBend); },
+			[&arena](const message::ChannelPressure& m)->std::shared_ptr<const Event> { return allocateShared<EventChannelPressure>(arena, m.channel, m.channelPressure); },
+			[&arena](const message::SystemExclusive& m)->std::shared_ptr<const Event> { return allocateShared<EventSystemExclusive>(arena, m.data); },
+			[&arena](const message::Meta& m)->std::shared_ptr<const Event> { return allocateShared<EventMeta>(arena, m.type, m.data); },
+		}, m);
+	}
+
+	// Message の SMFデータのバイト数
+	inline size_t encodedSize(const Message& m) {
+		return std::visit(utility::Overloaded{
+			[](const message::ProgramChange&)->size_t { return 2; },
+			[](const message::ChannelPressure&)->size_t { return 2; },
+			[](const message::SystemExclusive& m)->size_t { return m.data.size() + utility::getVariableValueSize(m.data.size() - 1); },
+			[](const message::Meta& m)->size_t { return 2 + utility::getVariableValueSize(m.data.size()) + m.data.size(); },
+			[](const auto&)->size_t { return 3; },
+		}, m);
+	}
+
+	// Message を SMFデータで p へ書き込む(戻り値:書き込んだ次の位置)
+	inline uint8_t* encode(const Message& m, uint8_t* p) {
+		return std::visit(utility::Overloaded{
+			[p](const message::NoteOff& m) { return EventNoteOff(m.channel, m.note, m.velocity).encode(p); },
+			[p](const message::NoteOn& m) { return EventNoteOn(m.channel, m.note, m.velocity).encode(p); },
+			[p](const message::PolyphonicKeyPressure& m) { return EventPolyphonicKeyPressure(m.channel, m.note, m.pressure).encode(p); },
+			[p](const message::ControlChange& m) { return EventControlChange(m.channel, m.type, m.value).encode(p); },
+			[p](const message::ProgramChange& m) { return EventProgramChange(m.channel, m.programNo).encode(p); },
+			[p](const message::PitchBend& m) { return EventPitchBend(m.channel, m.pitchBend).encode(p); },
+			[p](const message::ChannelPressure& m) { return EventChannelPressure(m.channel, m.channelPressure).encode(p); },
+			[p](const message::SystemExclusive& m) {
+				uint8_t* q = p;
+				*q++ = m.data[0];
+				q = utility::writeVariableValue(m.data.size() - 1, q);		// データサイズ(-1:statusByteは除く)
+				return m.data.copyTo(q, 1);
+			},
+			[p](const message::Meta& m) {
+				uint8_t* q = p;
+				*q++ = EventMeta::statusByte;
+				*q++ = static_cast<uint8_t>(m.type);
+				q = utility::writeVariableValue(m.data.size(), q);		// データサイズ
+				return m.data.copyTo(q);
+			},
+		}, m);
+	}
+
+	// デコードせずに参照する SMF のイベント(参照先のデータより長く保持しないこと)
+	struct EventView {
+		uint8_t						status = 0;		// ステータスバイト(ランニングステータスは補完済み)
+		uint8_t						metaType = 0;	// メタイベントの種類(status == 0xff の時のみ)
+		std::span<const uint8_t>	data;			// データ部(チャンネルメッセージは1～2Byte、SysEx/メタはデータ長を除いたデータ)
+
+		bool isChannelMessage() const {
+			return status < 0xf0;
+		}
+		bool isSystemExclusive() const {
+			return status == 0xf0 || status == 0xf7;
+		}
+		bool isMeta() const {
+			return status == 0xff;
+		}
+		uint8_t channel() const {
+			return status & 0x0f;
+		}
+		uint8_t value(size_t index) const {		// チャンネルメッセージのデータバイト(0～127)
+			return data[index] & 0x7f;
+		}
+
+		// Event を生成する(arena を指定するとそこに確保する)
+		// owner(data の参照先を保持しているオブジェクト)を指定すると、SysEx/メタのデータはコピーせずに参照する
+		std::shared_ptr<const Event> toEvent(const std::shared_ptr<EventArena>& arena = nullptr, const std::shared_ptr<const void>& owner = nullptr) const {
+			switch (status & 0xf0) {
+			case EventNoteOff::statusByte:
+				return allocateShared<EventNoteOff>(arena, channel(), value(0), value(1));
+			case EventNoteOn::statusByte:
+				return allocateShared<EventNoteOn>(arena, channel(), value(0), value(1));
+			case EventPolyphonicKeyPressure::statusByte:
+				return allocateShared<EventPolyphonicKeyPressure>(arena, channel(), value(0), value(1));
+			case EventControlChange::statusByte:
+				return allocateShared<EventControlChange>(arena, channel(), value(0), value(1));
+			case EventProgramChange::statusByte:
+				return allocateShared<EventProgramChange>(arena, channel(), value(0));
+			case EventPitchBend::statusByte:
+				return allocateShared<EventPitchBend>(arena, channel(), (value(0) + value(1) * 0x80) - 8192);
+			case EventChannelPressure::statusByte:
+				return allocateShared<EventChannelPressure>(arena, channel(), value(0));
+			}
+			if (isSystemExclusive()) {
+				return allocateShared<EventSystemExclusive>(arena, Payload::borrow(owner, data, std::span(&status, 1)));
+			}
+			return allocateShared<EventMeta>(arena, static_cast<EventMeta::Type>(metaType), Payload::borrow(owner, data));
+		}
+
+		// Message を生成する
+		Message toMessage() const {
+			switch (status & 0xf0) {
+			case EventNoteOff::statusByte:				return message::NoteOff{ channel(), value(0), value(1) };
+			case EventNoteOn::statusByte:				return message::NoteOn{ channel(), value(0), value(1) };
+			case EventPolyphonicKeyPressure::statusByte:	return message::PolyphonicKeyPressure{ channel(), value(0), value(1) };
+			case EventControlChange::statusByte:		return message::ControlChange{ channel(), value(0), value(1) };
+			case EventProgramChange::statusByte:		return message::ProgramChange{ channel(), value(0) };
+			case EventPitchBend::statusByte:			return message::PitchBend{ channel(), static_cast<int16_t>((value(0) + value(1) * 0x80) - 8192) };
+			case EventChannelPressure::statusByte:		return message::ChannelPressure{ channel(), value(0) };
+			}
+			if (isSystemExclusive()) {
+				return message::SystemExclusive{ Payload(std::span(&status, 1), data) };
+			}
+			return message::Meta{ static_cast<EventMeta::Type>(metaType), Payload(data) };
+		}
+
+		// 具象イベントを一時オブジェクトとして作って f へ渡す(Event::visit と同じ振り分けを、ヒープに Event を確保せずに行う)
+		// SysEx/メタのデータは Payload にコピーする(16Byte以下ならヒープは使わない)
+		template <typename F> decltype(auto) visit(F&& f) const {
+			switch (status & 0xf0) {
+			case EventNoteOff::statusByte:				return f(EventNoteOff(channel(), value(0), value(1)));
+			case EventNoteOn::statusByte:				return f(EventNoteOn(channel(), value(0), value(1)));
+			case EventPolyphonicKeyPressure::statusByte:	return f(EventPolyphonicKeyPressure(channel(), value(0), value(1)));
+			case EventControlChange::statusByte:		return f(EventControlChange(channel(), value(0), value(1)));
+			case EventProgramChange::statusByte:		return f(EventProgramChange(channel(), value(0)));
+			case EventPitchBend::statusByte:			return f(EventPitchBend(channel(), static_cast<int16_t>((value(0) + value(1) * 0x80) - 8192)));
+			case EventChannelPressure::statusByte:		return f(EventChannelPressure(channel(), value(0)));
+			}
+			if (isSystemExclusive()) {
+				return f(EventSystemExclusive(Payload(std::span(&status, 1), data)));
+			}
+			return f(EventMeta(static_cast<EventMeta::Type>(metaType), Payload(data)));
+		}
+
+		// SMF の形式でエンコードされたイベント(デルタタイムを除く)を参照する
+		static EventView fromEncoded(std::span<const uint8_t> bytes) {
+			EventView view{ bytes[0] };
+			if (view.isChannelMessage()) {
+				view.data = bytes.subspan(1);
+			} else if (view.isSystemExclusive()) {
+				const auto len = utility::decodeVariableValue(bytes.data() + 1, bytes.data() + bytes.size());
+				view.data = bytes.subspan(1 + len.size);
+			} else if (view.isMeta()) {
+				view.metaType = bytes[1];
+				const auto len = utility::decodeVariableValue(bytes.data() + 2, bytes.data() + bytes.size());
+				view.data = bytes.subspan(2 + len.size);
+			}
+			return view;
+		}
+	};
+
 }
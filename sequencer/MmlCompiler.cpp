@@ -1,19 +1,21 @@
 ﻿
 
-#include <regex>
+#include <algorithm>
+#include <array>
+#include <map>
 #include <charconv>
 #include <variant>
 #include <optional>
 #include <iostream>
-#include <typeindex>
+#include <sstream>
+#include <typeinfo>
 
 
-#include <boost/lexical_cast.hpp>
-#include <boost/regex.hpp>
-
 #include "../json/Json.h"
 #include "../stringformat/StringFormat.h"
 
+#include "../parallel/Parallel.h"
+
 #include "./MmlCompiler.h"
 #include "./MidiEvent.h"
 
@@ -178,19 +180,135 @@ std::string MmlCompiler::Result::getJson(const std::vector<Result::Error>& error
 
 namespace {
 
-	using regex = boost::regex;
+	// 文字種(ASCII のみ。ロケールに依存しない)
+	namespace CharClass {
+		enum : uint8_t {
+			space = 1 << 0,		// 空白 " \t\n\v\f\r" (std::isspace の "C" ロケールと同じ)
+			digit = 1 << 1,		// [0-9]
+			alpha = 1 << 2,		// [a-zA-Z]
+			word = 1 << 3,		// \w [a-zA-Z0-9_]
+			wordSign = 1 << 4,	// [\w\+\-]
+		};
+		constexpr auto table = [] {
+			std::array<uint8_t, 256> t{};
+			for (const unsigned char c : std::string_view(" \t\n\v\f\r")) t[c] |= space;
+			for (int c = '0'; c <= '9'; c++) t[c] |= digit | word | wordSign;
+			for (int c = 'a'; c <= 'z'; c++) t[c] |= alpha | word | wordSign;
+			for (int c = 'A'; c <= 'Z'; c++) t[c] |= alpha | word | wordSign;
+			t['_'] |= word | wordSign;
+			t['+'] |= wordSign;
+			t['-'] |= wordSign;
+			return t;
+		}();
 
-	auto regexSearch(const std::string_view& text, const regex& re) {
-		// match_not_dot_newline  : . は改行以外にマッチさせる。(std::regexと同じにする)
-		// match_single_line	  : ^ は先頭行の行頭のみにマッチ
-		// boost::match_continuous: 先頭から始まる部分シーケンスにのみマッチすることを指定する
-		boost::match_results<std::string_view::const_iterator> m;
-		if (boost::regex_search(text.begin(), text.end(), m, re, boost::match_not_dot_newline | boost::match_single_line | boost::match_continuous)) {
-			return std::optional(m);
+		constexpr bool is(char c, uint8_t cls) {
+			return (table[static_cast<unsigned char>(c)] & cls) != 0;
+		}
+		// 先頭から cls の文字が続く文字数
+		constexpr size_t count(const std::string_view& text, uint8_t cls) {
+			size_t n = 0;
+			while (n < text.size() && is(text[n], cls)) n++;
+			return n;
+		}
+		// 先頭の空白を読み飛ばす
+		constexpr std::string_view skipSpace(const std::string_view& text) {
+			return text.substr(count(text, space));
 		}
-		return std::optional<decltype(m)>();
 	}
 
+	// 10進数の数字列のパース([0-9]+ allowMinus なら \-?[0-9]+)
+	// 数字列が T の範囲外なら例外(std::out_of_range)
+	template <typename T> auto parseDigits(const std::string_view& text, bool allowMinus = false) {
+		struct Result {
+			std::string_view	next;	// 次の位置
+			T					value;
+		};
+		const size_t sign = allowMinus && text.starts_with('-') ? 1 : 0;
+		const size_t n = sign + CharClass::count(text.substr(sign), CharClass::digit);
+		if (n == sign) return std::optional<Result>();
+		Result result;
+		const auto [ptr, ec] = std::from_chars(text.data(), text.data() + n, result.value, 10);
+		if (ec != std::errc{}) throw std::out_of_range("number out of range");
+		result.next = text.substr(n);
+		return std::optional(result);
+	}
+
+	// 関数名(関数形式のコマンド名)の完全ハッシュ
+	// 関数名とそれを受け付けるパーサの対応はここだけに書き、パーサは Function で指定する
+	namespace FunctionName {
+		enum class Function : uint8_t {
+			createPort, volume, expression, controlChange, pitchBend, pan, port,
+			createSequence, sequence, fineTune, coarseTune, masterVolume, meta, sysEx,
+			definePresetFM, definePresetPSG,
+		};
+		struct Entry {
+			std::string_view	name;
+			Function			function;
+		};
+		constexpr std::array<Entry, 23> entries = { {
+			{ "CreatePort", Function::createPort }, { "createPort", Function::createPort },
+			{ "V", Function::volume }, { "Volume", Function::volume },
+			{ "Ep", Function::expression }, { "Expression", Function::expression },
+			{ "CC", Function::controlChange }, { "ControlChange", Function::controlChange },
+			{ "PitchBend", Function::pitchBend },
+			{ "Pan", Function::pan },
+			{ "Port", Function::port }, { "port", Function::port },
+			{ "CreateSeq", Function::createSequence }, { "CreateSequence", Function::createSequence },
+			{ "Seq", Function::sequence }, { "Sequence", Function::sequence },
+			{ "FineTune", Function::fineTune },
+			{ "CoarseTune", Function::coarseTune },
+			{ "MasterVolume", Function::masterVolume },
+			{ "Meta", Function::meta },
+			{ "SysEx", Function::sysEx },
+			{ "DefinePresetFM", Function::definePresetFM },
+			{ "DefinePresetPSG", Function::definePresetPSG },
+		} };
+		static_assert(std::ranges::all_of(entries, [](const auto& e) { return !e.name.empty() && CharClass::count(e.name, CharClass::alpha) == e.name.size(); }));	// すべて英字
+		constexpr size_t tableSize = 64;
+
+		constexpr size_t hash(const std::string_view& name, uint32_t seed) {
+			uint32_t h = seed ^ static_cast<uint32_t>(name.size());
+			h = h * 31 + static_cast<unsigned char>(name.front());
+			h = h * 31 + static_cast<unsigned char>(name[name.size() / 2]);
+			h = h * 31 + static_cast<unsigned char>(name.back());
+			return (h ^ (h >> 7)) % tableSize;
+		}
+
+		// names が衝突しない seed をコンパイル時に探す
+		constexpr uint32_t seed = [] {
+			for (uint32_t seed = 0; true; seed++) {
+				std::array<bool, tableSize> used{};
+				bool collided = false;
+				for (const auto& e : entries) {
+					auto& u = used[hash(e.name, seed)];
+					collided |= u;
+					u = true;
+				}
+				if (!collided) return seed;
+			}
+		}();
+
+		constexpr auto table = [] {		// <ハッシュ値,entries のインデックス(-1:ナシ)>
+			std::array<int8_t, tableSize> t{};
+			t.fill(-1);
+			for (size_t i = 0; i < entries.size(); i++) {
+				t[hash(entries[i].name, seed)] = static_cast<int8_t>(i);
+			}
+			return t;
+		}();
+
+		// name が function の関数名か
+		constexpr bool is(const std::string_view& name, Function function) {
+			if (name.empty()) return false;
+			const auto i = table[hash(name, seed)];
+			return i >= 0 && entries[i].function == function && entries[i].name == name;
+		}
+		static_assert(is("Volume", Function::volume) && !is("Volume", Function::expression) && !is("Vol", Function::volume));
+	}
+
+	// 音名 a～g の半音(c を0とする)
+	constexpr std::array<int, 7> noteTable = { 9, 11, 0, 2, 4, 5, 7 };
+
 	// 文字列の前方一致比較
 	std::optional<std::string_view> isStartsWith(const std::string_view& text, const std::string_view& prefix) {
 		if (text.starts_with(prefix)) {
@@ -221,13 +339,11 @@ namespace {
 			return result;
 		}
 		if (result->next.starts_with('R')) {					// R"xx(・・・)xx" 形式の文字列
-			static const regex re(R"(^R\"(\w*)\()");
-			const auto m = regexSearch(result->next, re);
-			if (!m) return std::optional<Result>();					// 対象外(エラーではない)
-			const auto& delimiter = (*m)[1];
-			const auto iString = (*m)[0].second;					// 文字列開始位置
-			result->next.remove_prefix(std::distance(result->next.begin(), iString));	// 文字列開始位置まで進める
-			const auto sEnd = ")" + delimiter + "\"";				// 終端文字列
+			if (!result->next.starts_with("R\"")) return std::optional<Result>();		// 対象外(エラーではない)
+			const auto delimiter = result->next.substr(2, CharClass::count(result->next.substr(2), CharClass::word));
+			if (!result->next.substr(2 + delimiter.size()).starts_with('(')) return std::optional<Result>();	// 対象外(エラーではない)
+			result->next.remove_prefix(2 + delimiter.size() + 1);	// 文字列開始位置まで進める
+			const auto sEnd = ")" + std::string(delimiter) + "\"";	// 終端文字列
 			auto pos = result->next.find(sEnd);						// 終端を検索
 			if (pos == std::string_view::npos) return result;		// 終端が見つからないならパースエラー
 			result->value = result->next.substr(0, pos);			// パースした文字列
@@ -241,10 +357,7 @@ namespace {
 	std::string_view skipComment(const std::string_view& mml) {
 		auto next = mml;
 		while (true) {
-			// 先頭の空白を読み飛ばす
-			next.remove_prefix(std::distance(next.begin(), std::find_if(next.begin(), next.end(), [](unsigned char ch) {
-				return !std::isspace(ch); // return !std::isspace(ch, std::locale::classic()); gccでNG
-			})));
+			next = CharClass::skipSpace(next);		// 先頭の空白を読み飛ばす
 
 			if (const auto r = isStartsWith(next, "//")) {	// "//" コメント?
 				const size_t pos = r->find_first_of("\r\n");	// 終了位置(改行)検索
@@ -270,6 +383,16 @@ namespace {
 		return next;
 	};
 
+	// 関数名と "(" のパース(戻り値:関数名,"(" の次の位置)
+	// 関数名はすべて英字なので、先頭の英字の並びを関数名として完全ハッシュで引き、function のものか確認する
+	std::optional<std::pair<std::string_view, std::string_view>> parseFunctionName(const std::string_view& text, FunctionName::Function function) {
+		const auto name = text.substr(0, CharClass::count(text, CharClass::alpha));
+		if (!FunctionName::is(name, function)) return std::nullopt;
+		const auto r = isStartsWith(skipComment(text.substr(name.size())), '(');	// 関数の"(" を確認(間のコメントは読み飛ばす)
+		if (!r) return std::nullopt;
+		return std::pair(name, *r);
+	}
+
 	// 整数パース
 	auto parseInt(const std::string_view& text) {
 		struct Result {
@@ -315,22 +438,17 @@ namespace {
 			std::string_view	next;
 			double				value;
 		};
-#if 0
-		// emscripten では std::from_chars の double 版が使えない "call to deleted function 'from_chars'"
-		const auto [begin, end] = toAddress(iBegin, iEnd);
-		const auto [ptr, ec] = std::from_chars(begin, end, result.value, std::chars_format::fixed);	// 指数表記は不許可
-		if (ec != std::errc{}) return std::optional<decltype(result)>();
-		result.next = iBegin + (ptr - begin);
+		// [0-9]+(\.[0-9]*)? 符号と指数表記は対象外
+		size_t n = CharClass::count(text, CharClass::digit);
+		if (n == 0) return std::optional<Result>();
+		if (n < text.size() && text[n] == '.') {
+			n += 1 + CharClass::count(text.substr(n + 1), CharClass::digit);
+		}
+		Result result;
+		const auto [ptr, ec] = std::from_chars(text.data(), text.data() + n, result.value, std::chars_format::fixed);
+		if (ec != std::errc{}) throw std::out_of_range("number out of range");
+		result.next = text.substr(n);
 		return std::optional(result);
-#else
-		if (const auto m = regexSearch(text, regex(R"(^([0-9]+(\.[0-9]*)?))"))) {	// regex(R"(^(\+?[0-9]+(\.[0-9]*)?([eE][\+-]?[0-9]+)?))"
-			Result result;
-			result.value = boost::lexical_cast<double>((*m)[1].str());
-			result.next = std::string_view((*m)[0].second, text.end());
-			return std::optional(result);
-		}
-		return std::optional<Result>();
-#endif
 	}
 
 
@@ -519,25 +637,15 @@ namespace {
 
 	auto parseFunction(
 		const std::string_view& text,
-		const std::vector<std::string>& functionNames,				// 関数名
-		const std::set<std::string>& argNames,						// 名前付き引数名(ココにない引数名はエラー)
+		FunctionName::Function function,								// 関数(受け付ける関数名は FunctionName::entries)
+		const std::initializer_list<std::string_view>& argNames,		// 名前付き引数名(ココにない引数名はエラー)
 		const size_t argCount = (std::numeric_limits<size_t>::max)()	// 名前ナシ引数数(ココを超える数の引数はエラー)
 	) {
 		ParseFunctionResult result;
-		auto arg = [&]()->std::optional<std::string_view> {	// 
-			for (auto& name : functionNames) {
-				const auto r = isStartsWith(text, name);
-				if (!r) continue;
-				auto next = skipComment(*r);		// コメントを読み飛ばす
-				const auto r2 = isStartsWith(next, '(');	// 関数の"(" を確認
-				if (!r2) continue;
-				result.functionName = { text.begin(), text.begin() + name.size() };
-				return *r2;
-			}
-			return std::nullopt;
-		}();
-		if (!arg) return std::optional<ParseFunctionResult>();		// 該当しなかった
-		auto next = *arg;
+		const auto name = parseFunctionName(text, function);
+		if (!name) return std::optional<ParseFunctionResult>();		// 該当しなかった
+		result.functionName = name->first;
+		auto next = name->second;
 
 		std::string currentArgName;
 		union {									// 次トークン情報
@@ -576,13 +684,12 @@ namespace {
 			}
 
 			if (flags.argName) {		// 引数名
-				static const auto re = regex(R"(^([a-zA-Z]\w*))");
-				if (const auto m = regexSearch(next, re)) {
-					auto n = std::string_view((*m)[0].second, next.end());
-					n = skipComment(n);			// コメントを読み飛ばす
+				if (CharClass::is(next[0], CharClass::alpha)) {		// [a-zA-Z]\w*
+					const auto name = next.substr(0, 1 + CharClass::count(next.substr(1), CharClass::word));
+					const auto n = skipComment(next.substr(name.size()));	// コメントを読み飛ばす
 					if (const auto r = isStartsWith(n, ':')) {		// ":" があれば引数名で確定
-						currentArgName = (*m)[0].str();
-						if (auto i = argNames.find(currentArgName); i == argNames.end()) {	// 引数名チェック
+						currentArgName = name;
+						if (std::find(argNames.begin(), argNames.end(), name) == argNames.end()) {	// 引数名チェック
 							throw MmlException(MmlCompiler::ErrorCode::argumentUnknownError, next);
 						}
 						next = *r;
@@ -646,14 +753,14 @@ namespace {
 			intmax_t tmpStep = defaultLength;
 
 			// 数値
-			if (const auto m = regexSearch(next, regex(R"(^([0-9]+))"))) {
-				size_t n = boost::lexical_cast<size_t>((*m)[1].str());
+			if (const auto r = parseDigits<size_t>(next)) {
+				const size_t n = r->value;
 				if (stepNotation) {
 					tmpStep = n;
 				} else {
 					tmpStep = (MmlCompiler::timeBase * 4) / n;
 				}
-				next = skipComment({ (*m)[0].second, next.end() });
+				next = skipComment(r->next);
 			} else {
 				if (stepNotation) {		// ステップ数指定しておきながら数値がないなら
 					throw MmlException(MmlCompiler::ErrorCode::lengthError, next);
@@ -661,13 +768,12 @@ namespace {
 			}
 
 			// 付点音符
-			if (const auto m = regexSearch(next, regex(R"(^(\.)+)"))) {
-				const size_t n = std::count((*m)[0].first, (*m)[0].second, '.');
+			if (const size_t dots = (std::min)(next.find_first_not_of('.'), next.size()); dots != 0) {
 				size_t t = tmpStep / 2;
-				for (size_t j = 0; j < n; j++, t /= 2) {
+				for (size_t j = 0; j < dots; j++, t /= 2) {
 					tmpStep += t;
 				}
-				next = skipComment({ (*m)[0].second, next.end() });		// コメントを読み飛ばす
+				next = skipComment(next.substr(dots));		// コメントを読み飛ばす
 			}
 
 			step += tmpStep * (plus ? 1 : -1);
@@ -737,12 +843,11 @@ namespace {
 					}
 
 					if (flags.argName) {		// 引数名
-						static const auto re = regex(R"(^([a-zA-Z]\w*))");
-						if (const auto m = regexSearch(next, re)) {
-							auto n = std::string_view((*m)[0].second, next.end());
-							n = skipComment(n);			// コメントを読み飛ばす
+						if (CharClass::is(next[0], CharClass::alpha)) {		// [a-zA-Z]\w*
+							const auto name = next.substr(0, 1 + CharClass::count(next.substr(1), CharClass::word));
+							const auto n = skipComment(next.substr(name.size()));	// コメントを読み飛ばす
 							if (const auto r = isStartsWith(n, ':')) {		// ":" があれば引数名で確定
-								currentArgName = std::string_view(std::to_address((*m)[0].first), (*m)[0].length());
+								currentArgName = name;
 
 								if (disableArgName) {	// 名前付き引数は非サポート
 									throw MmlException(MmlCompiler::ErrorCode::argumentError, currentArgName);	// 名前アリ引数は未対応
@@ -774,69 +879,123 @@ namespace {
 
 		};
 
-		std::optional<Args> parse(const std::string_view& text, const std::vector<std::string>& functionNames, bool disableArgName) {
-			for (auto& name : functionNames) {
-				const auto r = isStartsWith(text, name);
-				if (!r) continue;
-				auto next = skipComment(*r);		// コメントを読み飛ばす
-				const auto r2 = isStartsWith(next, '(');	// 関数の"(" を確認
-				if (!r2) continue;
-				Args args{ *r2, { text.begin(), text.begin() + name.size() }, disableArgName };
-				return std::optional(args);
-			}
-			return std::nullopt;
+		std::optional<Args> parse(const std::string_view& text, FunctionName::Function function, bool disableArgName) {
+			const auto name = parseFunctionName(text, function);
+			if (!name) return std::nullopt;
+			Args args{ name->second, name->first, disableArgName };
+			return std::optional(args);
 		};
 
 	};
 
 }
 
-class MmlCompiler::Inner {
-public:
+namespace {
+	struct InterPitchBend;
+	struct InterPan;
+	struct InterExpression;
+	struct InterVolume;
+	struct InterFineTune;
+	struct InterCoarseTune;
+	struct InterMasterVolume;
+	struct InterTempo;
+
+	// 具象中間イベントへの参照
+	using InterRef = std::variant<
+		const InterPitchBend*,
+		const InterPan*,
+		const InterExpression*,
+		const InterVolume*,
+		const InterFineTune*,
+		const InterCoarseTune*,
+		const InterMasterVolume*,
+		const InterTempo*
+	>;
+}
 
-	struct InterEvent : public MmlCompiler::EventBase {
-		ParseNum::Assign 	assign;
-	};
-	struct InterPitchBend : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterPitchBend>(*this);
+// 中間イベント(相対指定できるコマンド。Inner::Resolver がポートの現在値から MIDI イベントに置き換える)
+struct MmlCompiler::InterEvent : public MmlCompiler::EventBase {
+	ParseNum::Assign 	assign;
+	virtual EventRef ref() const {
+		return this;
+	}
+	virtual InterRef interRef() const = 0;		// 具象中間イベントへの参照
+
+	// 具象中間イベントの型で f を呼ぶ(f(const InterPan&) 等)
+	template <typename F> decltype(auto) visit(F&& f) const {
+		return std::visit([&f](const auto* p) -> decltype(auto) {return f(*p); }, interRef());
+	}
+};
+
+namespace {
+	struct InterPitchBend : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterPitchBend>(arena, *this);
 		}
 	};
-	struct InterPan : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterPan>(*this);
+	struct InterPan : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterPan>(arena, *this);
 		}
 	};
-	struct InterExpression : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterExpression>(*this);
+	struct InterExpression : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterExpression>(arena, *this);
 		}
 	};
-	struct InterVolume : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterVolume>(*this);
+	struct InterVolume : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterVolume>(arena, *this);
 		}
 	};
-	struct InterFineTune : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterFineTune>(*this);
+	struct InterFineTune : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterFineTune>(arena, *this);
 		}
 	};
-	struct InterCoarseTune : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterCoarseTune>(*this);
+	struct InterCoarseTune : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterCoarseTune>(arena, *this);
 		}
 	};
-	struct InterMasterVolume : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterMasterVolume>(*this);
+	struct InterMasterVolume : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterMasterVolume>(arena, *this);
 		}
 	};
-	struct InterTempo : public InterEvent {
-		virtual std::shared_ptr<EventBase> clone()const {
-			return std::make_shared<InterTempo>(*this);
+	struct InterTempo : public MmlCompiler::InterEvent {
+		virtual InterRef interRef() const {
+			return this;
+		}
+		virtual std::shared_ptr<EventBase> clone(const MmlCompiler::Arena& arena)const {
+			return midi::allocateShared<InterTempo>(arena, *this);
 		}
 	};
+}
+
+class MmlCompiler::Inner {
+public:
 
 	struct Sequence {
 		std::string			name;
@@ -851,39 +1010,220 @@ public:
 	};
 	using Sequences = std::set<std::shared_ptr<const Sequence>, LessName<std::shared_ptr<const Sequence>>>;
 
-	static std::vector<Port> mmlToSequence(const std::string_view& targetMml, const Sequences& sequences) {
-		struct PortInfo {
-			size_t						position = 0;			// 現在の位置
-			size_t						defaultStep = 480;		// デフォルト音長(step)
-			int							octave = 4;				// 現在のオクターブ( -2 ～ 8 )
-			double						velocity = 100.0;		// 現在のベロシティ(0～127)
-			std::shared_ptr<EventNote>	beforeEvent;			// 直前の音符( ^の対象)
-			bool						noteUnmove = false;		// Noteで現在位置を進めないモード
-			MmlCompiler::Port			port;
+	// 中間イベントの解決
+	// 中間イベント(相対指定できるコマンド)はポートの楽器・チャンネル毎の現在値から MIDI イベントにする
+	// 全ポートの中間イベントを位置順に処理すること
+	class Resolver {
+	public:
+		using Events = std::vector<std::shared_ptr<const EventBase>>;
+
+		explicit Resolver(const Arena& arena)
+			:m_arena(arena)
+		{}
+
+		// 中間イベントで現在値を更新する(MIDI イベントは作らない)
+		void apply(const Port& port, const InterEvent& event) {
+			resolve(port, event, nullptr);
+		}
+
+		// 中間イベントで現在値を更新して、置き換える MIDI イベントを返す
+		Events resolve(const Port& port, const InterEvent& event) {
+			Events events;
+			resolve(port, event, &events);
+			return events;
+		}
+
+		// 中間イベントで現在値を更新して、itEvent を MIDI イベントに置き換える
+		void replace(Port& port, EventList::const_iterator itEvent) {
+			auto events = resolve(port, static_cast<const InterEvent&>(*itEvent->second));
+			for (auto& e : events) {
+				port.eventList.emplace_hint(itEvent, itEvent->first, std::move(e));	// Eventを挿入
+			}
+			port.eventList.erase(itEvent);	// 不要になったEventを削除
+		}
+
+	private:
+		struct Channel {
+			double expression = 127.0;	// エクスプレッション (0.0～127.0)
+			double volume = 100.0;		// ボリューム (0.0～127.0)
+			double pan = 64;			// パン (0.0～127.0)
+			double pitchBend = 0.0;		// ピッチベンド (-8192～8191)
+			double fineTune = 0.0;		// FineTune (-100.0～100.0)
+			double coarseTune = 0.0;	// coarseTune (-64.0～63.0)
+		};
+		struct Instrument {
+			double masterVolume = 16383.0;	// マスターボリューム
+			std::map<uint8_t, Channel>	channels;	// <channelNo,Channel>
 		};
-		struct State {
-			const Sequences& parentSequences;	// 親から(引数で)引き継がれたsequences
-			std::vector<Result::Error> errors;
-			std::map<std::string_view, PortInfo>	mapPort;	// <Port名,PortInfo>
-			PortInfo* currentPort = nullptr;
-			Sequences						sequences;
-			struct PastedSequence {
-				size_t							position = 0;
-				std::shared_ptr<const Sequence>	sequence;
-				std::optional<size_t>			length;
-			};
-			std::list<PastedSequence>	pastedSequences;
-		}state = { sequences, };
-		state.currentPort = &state.mapPort[""];
 
-		struct Parser {
-			ErrorCode errorCode;
-			std::optional<std::string_view>(*func)(State&, const std::string_view&);
+		// event で現在値を更新し、events があれば置き換える MIDI イベントを追加する
+		void resolve(const Port& port, const InterEvent& event, Events* events) {
+			auto& instrument = m_instruments[port.instrument];
+			auto& ch = instrument.channels[port.channel];
+			event.visit(midi::utility::Overloaded{
+				[&](const InterPitchBend& e) {
+					ch.pitchBend = e.assign.apply(ch.pitchBend);
+					if (!events) return;
+					auto ev = midi::allocateShared<EventPitchBend>(m_arena);
+					ev->pitchBend = std::clamp(static_cast<int>(std::lround(ch.pitchBend)), -8192, 8191);
+					events->emplace_back(std::move(ev));
+				},
+				[&](const InterPan& e) {
+					ch.pan = e.assign.apply(ch.pan);
+					if (!events) return;
+					auto ev = midi::allocateShared<EventControlChange>(m_arena);
+					ev->no = static_cast<decltype(ev->no)>(midi::EventControlChange::Type::pan);
+					ev->value = std::clamp(static_cast<int>(std::lround(ch.pan)), 0, 127);
+					events->emplace_back(std::move(ev));
+				},
+				[&](const InterExpression& e) {
+					ch.expression = e.assign.apply(ch.expression);
+					if (!events) return;
+					auto ev = midi::allocateShared<EventControlChange>(m_arena);
+					ev->no = static_cast<decltype(ev->no)>(midi::EventControlChange::Type::expression);
+					ev->value = std::clamp(static_cast<int>(std::lround(ch.expression)), 0, 127);
+					events->emplace_back(std::move(ev));
+				},
+				[&](const InterVolume& e) {
+					ch.volume = e.assign.apply(ch.volume);
+					if (!events) return;
+					auto ev = midi::allocateShared<EventControlChange>(m_arena);
+					ev->no = static_cast<decltype(ev->no)>(midi::EventControlChange::Type::volume);
+					ev->value = std::clamp(static_cast<int>(std::lround(ch.volume)), 0, 127);
+					events->emplace_back(std::move(ev));
+				},
+				[&](const InterFineTune& e) {
+					ch.fineTune = e.assign.apply(ch.fineTune);
+					if (!events) return;
+					const auto toRaw = [](double fineTune) {
+						constexpr double inMin = -100.0, inMax = 100.0;
+						constexpr int outMax = 16383;
+						return std::clamp(static_cast<int>(std::round((fineTune - inMin) * (outMax + 1) / (inMax - inMin))), 0, outMax);	// -8192～0～8192 スケール(+100には微妙に届かない)
+					};
+					const auto raw = toRaw(ch.fineTune);
+
+					struct {
+						midi::EventControlChange::Type no;
+						uint8_t val;
+					}const tbl[] = {
+						{midi::EventControlChange::Type::rpnMSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::fineTune) / 0x80 & 0x7f	},
+						{midi::EventControlChange::Type::rpnLSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::fineTune) & 0x7f	},
+						{midi::EventControlChange::Type::dataEntryMSB,	static_cast<uint8_t>(raw / 0x80 & 0x7f)	},
+						{midi::EventControlChange::Type::dataEntryLSB,	static_cast<uint8_t>(raw & 0x7f)	},
+					};
+					for (auto& t : tbl) {
+						auto ev = midi::allocateShared<EventControlChange>(m_arena);
+						ev->no = static_cast<decltype(ev->no)>(t.no);
+						ev->value = t.val;
+						events->emplace_back(std::move(ev));
+					}
+				},
+				[&](const InterCoarseTune& e) {
+					ch.coarseTune = e.assign.apply(ch.coarseTune);
+					if (!events) return;
+					const int val = std::clamp(static_cast<int>(std::lround(ch.coarseTune)), -64, 63);
+					struct {
+						midi::EventControlChange::Type no;
+						uint8_t val;
+					}const tbl[] = {
+							{midi::EventControlChange::Type::rpnMSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::coarseTune) / 0x80 & 0x7f	},
+							{midi::EventControlChange::Type::rpnLSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::coarseTune) & 0x7f	},
+							{midi::EventControlChange::Type::dataEntryMSB,	static_cast<uint8_t>((val + 64) & 0x7f)	},
+							{midi::EventControlChange::Type::dataEntryLSB,	0	},
+					};
+					for (auto& t : tbl) {
+						auto ev = midi::allocateShared<EventControlChange>(m_arena);
+						ev->no = static_cast<decltype(ev->no)>(t.no);
+						ev->value = t.val;
+						events->emplace_back(std::move(ev));
+					}
+				},
+				[&](const InterMasterVolume& e) {
+					instrument.masterVolume = e.assign.apply(instrument.masterVolume);
+					if (!events) return;
+					auto ev = midi::allocateShared<EventSystemExclusive>(m_arena);
+					midi::utility::Bit14 u(static_cast<uint16_t>(std::clamp(static_cast<int>(std::lround(instrument.masterVolume)), 0, 16383)));
+					ev->data = { 0xf0, 0x7f, 0x7f, 0x04, 0x1, static_cast<uint8_t>(u.lsb), static_cast<uint8_t>(u.msb), 0xf7 };
+					events->emplace_back(std::move(ev));
+				},
+				[&](const InterTempo& e) {
+					m_tempo = e.assign.apply(m_tempo);
+					assert(std::isfinite(m_tempo));
+					if (!events) return;
+					auto ev = midi::allocateShared<EventMeta>(m_arena);
+					auto t = midi::EventMeta::createTempo(std::clamp(m_tempo, 1.0, 1000.0));	// createTempoを利用
+					ev->type = static_cast<decltype(ev->type)>(t.type);
+					ev->data = t.data.toVector();
+					events->emplace_back(std::move(ev));
+				},
+			});
+		}
+
+		Arena	m_arena;					// イベントを確保するアリーナ
+		std::map<std::string_view, Instrument> m_instruments;		// <instrument名,Instrument>
+		double	m_tempo = 120.0;			// テンポ
+	};
+
+	struct PortInfo {
+		size_t						position = 0;			// 現在の位置
+		size_t						defaultStep = 480;		// デフォルト音長(step)
+		int							octave = 4;				// 現在のオクターブ( -2 ～ 8 )
+		double						velocity = 100.0;		// 現在のベロシティ(0～127)
+		std::shared_ptr<EventNote>	beforeEvent;			// 直前の音符( ^の対象)
+		bool						noteUnmove = false;		// Noteで現在位置を進めないモード
+		MmlCompiler::Port			port;
+
+		void append(std::shared_ptr<const EventBase> e) {	// 現在の位置にイベントを追加(位置は単調増加なので末尾に追加)
+			port.eventList.emplace_hint(port.eventList.end(), position, std::move(e));
+		}
+	};
+	struct State {
+		const Sequences& parentSequences;	// 親から(引数で)引き継がれたsequences
+		const Arena& arena;					// イベントを確保するアリーナ
+		const Options& options;
+		std::vector<Result::Error> errors;
+		std::map<std::string_view, PortInfo>	mapPort;	// <Port名,PortInfo>
+		PortInfo* currentPort = nullptr;
+		Sequences						sequences;
+		std::vector<std::shared_ptr<Sequence>>	createdSequences;	// sequences のうちここで作ったもの(作った順。Session が string_view を付け替える)
+		struct PastedSequence {
+			size_t							position = 0;
+			std::shared_ptr<const Sequence>	sequence;
+			std::optional<size_t>			length;
+		};
+		std::list<PastedSequence>	pastedSequences;
+		struct PendingSequence {		// 本体のコンパイルを後回しにした CreateSequence
+			std::shared_ptr<Sequence>	sequence;		// state.sequences に登録済み(ports はコンパイル後に設定)
+			std::string_view			mml;			// 本体の MML
+			std::string_view			text;			// CreateSequence コマンド(エラー箇所)
+			Sequences					scope;			// 定義時点で参照できる Sequence
+			size_t						errorIndex = 0;	// 本体のエラーを挿入する errors の位置
 		};
+		bool							deferSequences = false;		// CreateSequence の本体をまとめて並列にコンパイルする
+		std::vector<PendingSequence>	pendingSequences;
+
+		State(const Sequences& parentSequences, const Arena& arena, const Options& options)
+			:parentSequences(parentSequences)
+			, arena(arena)
+			, options(options)
+		{
+			currentPort = &mapPort[""];
+			currentPort->port.eventList = EventList(EventList::allocator_type(arena));
+		}
+	};
+
+	struct Parser {
+		ErrorCode errorCode;
+		std::string_view heads;		// 対象となる先頭文字(ディスパッチ用)
+		std::optional<std::string_view>(*func)(State&, const std::string_view&);
+	};
+
+	// コマンドのパーサー(先頭文字毎のディスパッチ表)
+	static const std::array<std::vector<const Parser*>, 256>& getDispatch() {
 		static const std::initializer_list<Parser> parsers = {
 
 			// ^ tie (長さを付け足す)
-			{ErrorCode::tieCommandError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ErrorCode::tieCommandError,"^",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, '^');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);				// コメントを読み飛ばす
@@ -899,7 +1239,7 @@ public:
 			}},
 
 			// r?? 休符
-			{ErrorCode::rCommandRangeError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ErrorCode::rCommandRangeError,"r",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, 'r');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);				// コメントを読み飛ばす
@@ -911,8 +1251,8 @@ public:
 			}},
 
 			// CreatePort
-			{ErrorCode::createPortError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto r = parseFunction(text, { "CreatePort","createPort" }, { "name","instrument","channel" });
+			{ErrorCode::createPortError,"Cc",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto r = parseFunction(text, FunctionName::Function::createPort, { "name","instrument","channel" });
 				if (!r) return std::nullopt;
 				const auto name = (*r).findArgString("name").value_or("");
 				if (name.empty()) throw MmlException(ErrorCode::createPortPortNameError, text);
@@ -920,6 +1260,7 @@ public:
 				if (!r2.second) throw MmlException(ErrorCode::createPortDuplicateError, text);	// 既にあるなら
 				auto& port = r2.first->second;
 				port.port.name = name;
+				port.port.eventList = EventList(EventList::allocator_type(state.arena));
 				if (const auto s = r->findArgString("instrument")) port.port.instrument = *s;
 				const auto ch = r->findArg<uintmax_t>("channel").second;
 				if (!ch || *ch < 1 || *ch > 16) throw MmlException(ErrorCode::createPortChannelError, text);
@@ -929,36 +1270,23 @@ public:
 			}},
 
 			// a～g?? 音符
-			{ErrorCode::noteCommandRangeError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				static const regex re(R"(^([a-g][\+\-]?))");
-				const auto m = regexSearch(text, re);
-				if (!m) return std::nullopt;
-				auto next = std::string_view((*m)[0].second, text.end());
-				next = skipComment(next);			// コメントを読み飛ばす
+			{ErrorCode::noteCommandRangeError,"abcdefg",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				if (text.empty() || text[0] < 'a' || text[0] > 'g') return std::nullopt;	// [a-g][\+\-]?
+				const int accidental = text.size() > 1 ? (text[1] == '+' ? 1 : text[1] == '-' ? -1 : 0) : 0;	// 臨時記号(+ - による半音)
+				auto next = skipComment(text.substr(accidental != 0 ? 2 : 1));	// コメントを読み飛ばす
 				auto& port = *state.currentPort;
 				const auto len = parseLength(next, port.defaultStep);
-				auto e = std::make_shared<EventNote>();
+				auto e = midi::allocateShared<EventNote>(state.arena);
 				e->note = [&] {
-					static const std::map<std::string, int> noteTable{
-						{"c",	0},	{"c-",	-1},{"c+",	1},
-						{"d",	2},	{"d-",	1},	{"d+",	3},
-						{"e",	4},	{"e-",	3},	{"e+",	5},
-						{"f",	5},	{"f-",	4},	{"f+",	6},
-						{"g",	7},	{"g-",	6},	{"g+",	8},
-						{"a",	9},	{"a-",	8},	{"a+",	10},
-						{"b",	11},{"b-",	10},{"b+",	12},
-					};
-					if (auto i = noteTable.find((*m)[0].str()); i != noteTable.end()) {
-						int note = (port.octave + 2) * 12 + i->second;
-						if (note >= 0 && note <= 127) {		// 範囲チェック
-							return note;
-						}
+					const int note = (port.octave + 2) * 12 + noteTable[text[0] - 'a'] + accidental;
+					if (note >= 0 && note <= 127) {		// 範囲チェック
+						return note;
 					}
 					throw MmlException(ErrorCode::noteCommandRangeError, text);
 				}();
 				e->length = len.step;
 				e->velocity = std::clamp(static_cast<int>(std::lround(port.velocity)), 0, 127);
-				port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				if (!port.noteUnmove) {
 					port.position += len.step;
 				}
@@ -967,7 +1295,7 @@ public:
 			}},
 
 			// v? ベロシティ
-			{ErrorCode::vCommandError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ErrorCode::vCommandError,"v",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, 'v');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);			// コメントを読み飛ばす
@@ -985,7 +1313,7 @@ public:
 			}},
 
 			// < > オクターブUPDOWN
-			{ ErrorCode::octaveUpDownCommandError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ ErrorCode::octaveUpDownCommandError,"<>",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto check = [&](int n) {
 					auto& port = *state.currentPort;
 					port.octave += n;
@@ -1004,25 +1332,24 @@ public:
 			} },
 
 			// o?? オクターブ
-			{ ErrorCode::oCommandError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ ErrorCode::oCommandError,"o",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, 'o');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);			// コメントを読み飛ばす
-				static const regex re(R"(^(\-?[0-9]+))");
-				const auto m = regexSearch(next, re);
+				const auto m = parseDigits<int>(next, true);
 				if (!m) throw MmlException(ErrorCode::oCommandRangeError, text);
 				auto& port = *state.currentPort;
-				int octave = boost::lexical_cast<int>((*m)[1].str());
+				const int octave = m->value;
 				if (octave < -2 || octave > 8) {		// 範囲チェック
 					throw MmlException(ErrorCode::oCommandRangeError, text);
 				}
 				port.octave = octave;
 				port.beforeEvent.reset();				// '^'の対象をクリア
-				return std::string_view((*m)[0].second, next.end());
+				return m->next;
 			} },
 
 			// l?? デフォルト音長
-			{ ErrorCode::lCommandError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ ErrorCode::lCommandError,"l",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, 'l');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);			// コメントを読み飛ばす
@@ -1033,7 +1360,7 @@ public:
 			} },
 
 			// ' noteで位置更新するか否かモード
-			{ ErrorCode::unknownError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ ErrorCode::unknownError,"'",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, '\'');
 				if (!r) return std::nullopt;
 				auto& port = *state.currentPort;
@@ -1043,21 +1370,21 @@ public:
 			} },
 
 			// @? プログラムチェンジ
-			{ ErrorCode::programchangeCommandError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ ErrorCode::programchangeCommandError,"@",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, '@');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);			// コメントを読み飛ばす
-				const auto m = regexSearch(next, regex(R"(^([0-9]+))"));
+				const auto m = parseDigits<int>(next);
 				if (!m) throw MmlException(ErrorCode::programchangeCommandError, next);
 				auto& port = *state.currentPort;
-				auto e = std::make_shared<EventProgramChange>();
-				e->programNo = boost::lexical_cast<int>((*m)[1].str());
-				port.port.eventList.emplace(port.position, e);
-				return std::string_view((*m)[0].second, next.end());
+				auto e = midi::allocateShared<EventProgramChange>(state.arena);
+				e->programNo = m->value;
+				port.append(e);
+				return m->next;
 			} },
 
 			// t?? テンポ
-			{ ErrorCode::tCommandRangeError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ ErrorCode::tCommandRangeError,"t",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				const auto r = isStartsWith(text, 't');
 				if (!r) return std::nullopt;
 				auto next = skipComment(*r);			// コメントを読み飛ばす
@@ -1069,16 +1396,16 @@ public:
 				} else {								// 相対指定なら
 					if (tempo < -100 || tempo > 100) throw MmlException(ErrorCode::rangeError, r2->matched);
 				}
-				auto e = std::make_shared<InterTempo>();
+				auto e = midi::allocateShared<InterTempo>(state.arena);
 				e->assign = *r2;
 				auto& port = *state.currentPort;
-				port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				return r2->next;
 			} },
 
 			// Volume
-			{ ErrorCode::volumeError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "V","Volume" }, true);
+			{ ErrorCode::volumeError,"V",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::volume, true);
 				if (!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1093,9 +1420,9 @@ public:
 								if (*val < 0 || *val > 127) throw MmlException(ErrorCode::volumeRangeError, r->matched);
 							} else assert(false);
 						}
-						auto e = std::make_shared<InterVolume>();
+						auto e = midi::allocateShared<InterVolume>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1105,8 +1432,8 @@ public:
 			} },
 
 			// Expression
-			{ ErrorCode::expressionError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "Ep","Expression"}, true);
+			{ ErrorCode::expressionError,"E",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::expression, true);
 				if(!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1121,9 +1448,9 @@ public:
 								if (*val < 0 || *val > 127) throw MmlException(ErrorCode::expressionRangeError, r->matched);
 							} else assert(false);
 						}
-						auto e = std::make_shared<InterExpression>();
+						auto e = midi::allocateShared<InterExpression>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1133,8 +1460,8 @@ public:
 			} },
 
 			// ControlChange
-			{ ErrorCode::controlChangeError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				auto r = parseFunction(text, { "CC","ControlChange" }, { "no","value" });
+			{ ErrorCode::controlChangeError,"C",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				auto r = parseFunction(text, FunctionName::Function::controlChange, { "no","value" });
 				if (!r) return std::nullopt;
 				const auto no = [&] {
 					if (auto v = r->findArg<uintmax_t>(0).second) return *v;
@@ -1150,16 +1477,16 @@ public:
 					throw MmlException(ErrorCode::controlChangeRangeError, text);
 				}
 				auto& port = *state.currentPort;
-				auto e = std::make_shared<EventControlChange>();
+				auto e = midi::allocateShared<EventControlChange>(state.arena);
 				e->no = static_cast<decltype(e->no)>(no);
 				e->value = static_cast<decltype(e->value)>(val);
-				port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				return r->next;
 			} },
 				
 			// PitchBend
-			{ ErrorCode::pitchBendError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "PitchBend" }, true);
+			{ ErrorCode::pitchBendError,"P",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::pitchBend, true);
 				if (!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1174,9 +1501,9 @@ public:
 								if (*val < -8192 || *val > 8191) throw MmlException(ErrorCode::pitchBendRangeError, r->matched);
 							} else assert(false);
 						}
-						auto e = std::make_shared<InterPitchBend>();
+						auto e = midi::allocateShared<InterPitchBend>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1186,8 +1513,8 @@ public:
 			} },
 
 			// Pan
-			{ ErrorCode::panError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "Pan"}, true);
+			{ ErrorCode::panError,"P",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::pan, true);
 				if (!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1202,9 +1529,9 @@ public:
 								if (*val < 0 || *val > 127) throw MmlException(ErrorCode::panRangeError, r->matched);
 							} else assert(false);
 						}
-						auto e = std::make_shared<InterPan>();
+						auto e = midi::allocateShared<InterPan>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1214,8 +1541,8 @@ public:
 			} },
 
 			// Port
-			{ ErrorCode::portError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				auto r = parseFunction(text, { "Port","port" }, {});
+			{ ErrorCode::portError,"Pp",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				auto r = parseFunction(text, FunctionName::Function::port, {});
 				if (!r) return std::nullopt;
 				const auto name = (*r).findArgString(0).value_or("");
 				if (name.empty()) {
@@ -1229,8 +1556,8 @@ public:
 			} },
 				
 			// CreateSequence
-			{ErrorCode::createSequenceError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				auto r = parseFunction(text, { "CreateSeq","CreateSequence" }, { "name","mml" });
+			{ErrorCode::createSequenceError,"C",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				auto r = parseFunction(text, FunctionName::Function::createSequence, { "name","mml" });
 				if (!r) return std::nullopt;
 				const auto name = (*r).findArgString("name").value_or("");
 				if (name.empty()) {
@@ -1243,37 +1570,28 @@ public:
 				if (!mml) {
 					throw MmlException(ErrorCode::createSequenceError, text);
 				}
-				Sequence seq;
-				seq.name = name;
+				auto spSequence = std::make_shared<Sequence>();
+				spSequence->name = name;
 
-				try {
-					Sequences parentSeq = state.parentSequences;
-					for (auto s : state.sequences) parentSeq.insert(s);		// sequencesを合成
-					seq.ports = mmlToSequence(*mml, parentSeq);
-				} catch (MmlException& e) {
-					state.errors.insert(state.errors.end(), e.errors.begin(), e.errors.end());
+				Sequences parentSeq = state.parentSequences;
+				for (auto s : state.sequences) parentSeq.insert(s);		// sequencesを合成
+				if (state.deferSequences) {		// 本体は Seq で参照されるかパースの最後にまとめてコンパイルする
+					state.pendingSequences.emplace_back(State::PendingSequence{ spSequence, *mml, text, std::move(parentSeq), state.errors.size() });
+				} else {
+					compileSequence(*spSequence, *mml, parentSeq, state.arena, state.options, state.errors);
 				}
-
-				seq.lastPosition = [&] {
-					size_t p = 0;
-					for (auto& port : seq.ports) {
-						if (auto i = port.eventList.rbegin(); i != port.eventList.rend()) {
-							p = (std::max)(p, i->first);
-						}
-					}
-					return p;
-				}();
-				auto spSequence = std::make_shared<Sequence>(std::move(seq));
 				state.sequences.insert(spSequence);
+				state.createdSequences.push_back(std::move(spSequence));
 				return r->next;
 			}},
 
 			// Sequence
-			{ErrorCode::sequenceError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				auto r = parseFunction(text, { "Seq","Sequence" }, { "length" });
+			{ErrorCode::sequenceError,"S",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				auto r = parseFunction(text, FunctionName::Function::sequence, { "length" });
 				if (!r) return std::nullopt;
 				const auto name = (*r).findArgString(0).value_or("");
 				if (name.empty()) throw MmlException(ErrorCode::sequenceNameError, text);
+				compilePendingSequences(state);		// 貼り付ける Sequence の本体が未コンパイルかもしれない
 				decltype(state.pastedSequences)::value_type seq;
 				seq.sequence = [&] {
 					if (auto i = state.sequences.find(name); i != state.sequences.end()) {
@@ -1312,8 +1630,8 @@ public:
 			}},
 
 			// FineTune
-			{ErrorCode::fineTuneError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "FineTune"}, true);
+			{ErrorCode::fineTuneError,"F",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::fineTune, true);
 				if (!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1327,9 +1645,9 @@ public:
 						} else {							// 相対指定なら
 							if (n < -200.0 || n > 200.0) throw MmlException(ErrorCode::fineTuneRangeError, r->matched);
 						}
-						auto e = std::make_shared<InterFineTune>();
+						auto e = midi::allocateShared<InterFineTune>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1339,8 +1657,8 @@ public:
 			}},
 
 			// CoarseTune
-			{ErrorCode::coarseTuneError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "CoarseTune"}, true);
+			{ErrorCode::coarseTuneError,"C",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::coarseTune, true);
 				if (!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1353,9 +1671,9 @@ public:
 						}
 						const double n = r->getValue();
 						if (n < -64 || n > 63) throw MmlException(ErrorCode::coarseTuneRangeError, r->matched);
-						auto e = std::make_shared<InterCoarseTune>();
+						auto e = midi::allocateShared<InterCoarseTune>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1365,8 +1683,8 @@ public:
 			} },
 
 			// MasterVolume
-			{ ErrorCode::masterVolumeError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				const auto args = ParseFunc::parse(text, { "MasterVolume"}, true);
+			{ ErrorCode::masterVolumeError,"M",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				const auto args = ParseFunc::parse(text, FunctionName::Function::masterVolume, true);
 				if (!args) return std::nullopt;
 				const auto next = args->parse([&](const auto& argKey, const std::string_view& argValue) {
 					if (auto argIndex = std::get_if<std::size_t>(&argKey)) {
@@ -1381,9 +1699,9 @@ public:
 								if (*val < 0 || *val > 16383) throw MmlException(ErrorCode::masterVolumeRangeError, r->matched);
 							} else assert(false);
 						}
-						auto e = std::make_shared<InterMasterVolume>();
+						auto e = midi::allocateShared<InterMasterVolume>(state.arena);
 						e->assign = *r;
-						port.port.eventList.emplace(port.position, e);
+						port.append(e);
 						return r->next;
 					}
 					assert(false);
@@ -1393,15 +1711,15 @@ public:
 			} },
 
 			// Meta
-			{ErrorCode::metaError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				auto r = parseFunction(text, { "Meta" }, { "type" });
+			{ErrorCode::metaError,"M",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				auto r = parseFunction(text, FunctionName::Function::meta, { "type" });
 				if (!r) return std::nullopt;
 				const auto type = (*r).findArgInt("type");
 				if (!type || *type < 0 || *type > std::numeric_limits<uint8_t>::max()) {
 					throw MmlException(ErrorCode::metaTypeError, text);
 				}
 				auto& port = *state.currentPort;
-				auto e = std::make_shared<EventMeta>();
+				auto e = midi::allocateShared<EventMeta>(state.arena);
 				e->type = static_cast<decltype(e->type)>(*type);
 				for (auto& arg : r->argsList) {
 					std::visit([&](auto&& val) {
@@ -1419,16 +1737,16 @@ public:
 						}
 					}, arg);
 				}
-				port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				return r->next;
 			}},
 
 			// SysEx システムエクスクルーシブ
-			{ErrorCode::sysExError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
-				auto r = parseFunction(text, { "SysEx" }, {});
+			{ErrorCode::sysExError,"S",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+				auto r = parseFunction(text, FunctionName::Function::sysEx, {});
 				if (!r) return std::nullopt;
 				auto& port = *state.currentPort;
-				auto e = std::make_shared<EventSystemExclusive>();
+				auto e = midi::allocateShared<EventSystemExclusive>(state.arena);
 				for (auto& arg : r->argsList) {
 					std::visit([&](auto&& val) {
 						using T = std::decay_t<decltype(val)>;
@@ -1448,12 +1766,12 @@ public:
 				if (e->data.size() <= 0 || (e->data[0] != 0xf7 && e->data[0] != 0xf0)) {	// 先頭バイトチェック
 					throw MmlException(ErrorCode::sysExArgFirstError, text);
 				}
-				port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				return r->next;
 			}},
 
 			// DefinePresetFM FM音色定義(rlib-MML 固有メタイベント)
-			{ErrorCode::definePresetFMError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ErrorCode::definePresetFMError,"D",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				static constexpr std::array maxTable = {
 					//  AR  DR  SR  RR  SL  TL KS  ML DT
 						31, 31, 31, 15, 15,127, 3, 15, 7,
@@ -1462,7 +1780,7 @@ public:
 						31, 31, 31, 15, 15,127, 3, 15, 7,
 						7,	7,	//  AL  FB
 				};
-				auto r = parseFunction(text, { "DefinePresetFM" }, { "no","name" }, maxTable.size());
+				auto r = parseFunction(text, FunctionName::Function::definePresetFM, { "no","name" }, maxTable.size());
 				if (!r) return std::nullopt;
 				const auto no = (*r).findArgInt("no");
 				if (!no || *no < 0 || *no>127) {
@@ -1487,16 +1805,16 @@ public:
 					}},
 				};
 				auto& port = *state.currentPort;
-				auto e = std::make_shared<EventMeta>();
+				auto e = midi::allocateShared<EventMeta>(state.arena);
 				e->type = static_cast<decltype(e->type)>(midi::EventMeta::Type::sequencerLocal);
 				auto stringified = j.stringify();
 				e->data = { stringified.begin(), stringified.end() };
-				auto it = port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				return r->next;
 			}},
 
 			// DefinePresetPSG PSG(SSG)音色定義(rlib-MML 固有メタイベント)
-			{ErrorCode::definePresetPSGError,[](State& state,const std::string_view& text)->std::optional<std::string_view> {
+			{ErrorCode::definePresetPSGError,"D",[](State& state,const std::string_view& text)->std::optional<std::string_view> {
 				// AR,HR,DR,RR	アタック/ホールド/ディケイ/リリース時間(秒、0～60)
 				// SL			サステインレベル(0.0～1.0)
 				// noise		ノイズ周波数(0:OFF, 1～31)
@@ -1506,7 +1824,7 @@ public:
 					{0.0,timeMax}, {0.0,timeMax}, {0.0,timeMax}, {0.0,1.0}, {0.0,timeMax},
 				} };	// AR,HR,DR,SL,RR の順
 
-				auto r = parseFunction(text, { "DefinePresetPSG" }, { "no","name" }, envRange.size() + 2);	// +2: noise,tone
+				auto r = parseFunction(text, FunctionName::Function::definePresetPSG, { "no","name" }, envRange.size() + 2);	// +2: noise,tone
 				if (!r) return std::nullopt;
 				const auto no = (*r).findArgInt("no");
 				if (!no || *no < 0 || *no>127) {
@@ -1545,36 +1863,54 @@ public:
 					}},
 				};
 				auto& port = *state.currentPort;
-				auto e = std::make_shared<EventMeta>();
+				auto e = midi::allocateShared<EventMeta>(state.arena);
 				e->type = static_cast<decltype(e->type)>(midi::EventMeta::Type::sequencerLocal);
 				auto stringified = j.stringify();
 				e->data = { stringified.begin(), stringified.end() };
-				auto it = port.port.eventList.emplace(port.position, e);
+				port.append(e);
 				return r->next;
 			}},
 		};
 
-		for (auto next = targetMml; true;) {
+		// 先頭文字 → 対象となるパーサー(parsers の順)
+		// 先頭文字が対象外のパーサーは nullopt を返すだけなので、呼ばなくても結果は同じ
+		static const auto dispatch = [] {
+			std::array<std::vector<const Parser*>, 256> table;
+			for (const auto& parser : parsers) {
+				for (const unsigned char c : parser.heads) {
+					table[c].push_back(&parser);
+				}
+			}
+			return table;
+		}();
+		return dispatch;
+	}
+
+	// mml をパースして state に追加する
+	// onCommand(text) は各コマンドのパース前に呼ぶ(text はコマンドの先頭から末尾まで)
+	template <typename F> static void parse(State& state, const std::string_view& mml, F&& onCommand) {
+		const auto& dispatch = getDispatch();
+		for (auto next = mml; true;) {
 			try {
-				next.remove_prefix(std::distance(next.begin(), std::find_if(next.begin(), next.end(), [](unsigned char ch) {	// 先頭の空白を読み飛ばす(必要)
-					return !std::isspace(ch); // return !std::isspace(ch, std::locale::classic()); gccでNG
-				})));
+				next = CharClass::skipSpace(next);			// 先頭の空白を読み飛ばす(必要)
 				next = skipComment(next);			// コメントを読み飛ばす
 				if (next.empty()) break;					// 完了
-				auto i = parsers.begin();
-				for (; i != parsers.end(); i++) {
+				onCommand(next);
+				const auto& candidates = dispatch[static_cast<unsigned char>(next.front())];
+				auto i = candidates.begin();
+				for (; i != candidates.end(); i++) {
 					try {
-						if (const auto r = i->func(state, next)) {
+						if (const auto r = (*i)->func(state, next)) {
 							next = *r;
 							break;
 						}
 					} catch (const MmlException& e) {
 						throw e;
 					} catch (...) {
-						throw MmlException(i->errorCode, next);
+						throw MmlException((*i)->errorCode, next);
 					}
 				}
-				if (i == parsers.end()) throw MmlException(ErrorCode::unknownError, next);	// 未定義文字列エラー
+				if (i == candidates.end()) throw MmlException(ErrorCode::unknownError, next);	// 未定義文字列エラー
 			} catch (MmlException& e) {
 				state.errors.insert(state.errors.end(), e.errors.begin(), e.errors.end());
 
@@ -1591,6 +1927,119 @@ public:
 
 			}
 		}
+	}
+
+	// 貼り付けた Sequence の port を参照する Port::Paste(port も貼り付けなら元のポートを直接参照する)
+	static Port::Paste pasteView(const State::PastedSequence& pasted, const Port& port) {
+		const size_t length = pasted.length ? *pasted.length : (std::numeric_limits<size_t>::max)();	// length より後は採用しない
+		if (!port.paste) {
+			return Port::Paste{ .source = std::shared_ptr<const Port>(pasted.sequence, &port), .offset = pasted.position, .limit = length };
+		}
+		assert(port.paste->replaced.empty());		// Sequence のポートの中間イベントは解決していない
+		const auto& inner = *port.paste;
+		return Port::Paste{
+			.source = inner.source,
+			.offset = inner.offset + pasted.position,
+			.limit = (std::min)(inner.limit, length > inner.offset ? length - inner.offset : 0),
+		};
+	}
+
+	// 貼り付けた Sequence の port のイベントを p に追加する(貼り付け後の位置が from より前のイベントは除く)
+	static void appendPasted(Port& p, const State::PastedSequence& pasted, const Port& port, const Arena& arena, const Options& options, size_t from) {
+		const auto view = pasteView(pasted, port);
+		const auto& list = view.source->eventList;
+		const size_t begin = (std::min)(from > view.offset ? from - view.offset : 0, view.limit);		// limit を超えて始めない(貼り付けの終わりが from より前のとき)
+		for (auto i = list.lower_bound(begin), end = list.lower_bound(view.limit); i != end; i++) {
+			const auto& event = *i;
+			auto sp = options.shareEvents ? event.second : event.second->clone(arena);	// イベントは書き換えないので共有できる
+			p.eventList.emplace_hint(p.eventList.end(), event.first + view.offset, sp);
+		}
+	}
+	// 貼り付けた Sequence の port から Port を作る(イベントを複製する)
+	static Port paste(const State::PastedSequence& pasted, const Port& port, const Arena& arena, const Options& options) {
+		Port p{ .eventList = EventList(EventList::allocator_type(arena)) };
+		p.name = port.name;
+		p.instrument = port.instrument;
+		p.channel = port.channel;
+		appendPasted(p, pasted, port, arena, options, 0);
+		return p;
+	}
+
+	// Sequence の本体をコンパイルする(本体のエラーは errors に追加する)
+	static void compileSequence(Sequence& seq, const std::string_view& mml, const Sequences& scope, const Arena& arena, const Options& options, std::vector<Result::Error>& errors) {
+		try {
+			seq.ports = mmlToSequence(mml, scope, arena, options);
+		} catch (MmlException& e) {
+			errors.insert(errors.end(), e.errors.begin(), e.errors.end());
+		}
+
+		seq.lastPosition = [&] {
+			size_t p = 0;
+			for (auto& port : seq.ports) {
+				const auto& list = port.paste ? port.paste->source->eventList : port.eventList;
+				const auto offset = port.paste ? port.paste->offset : 0;
+				if (auto i = port.paste ? list.lower_bound(port.paste->limit) : list.end(); i != list.begin()) {
+					p = (std::max)(p, std::prev(i)->first + offset);
+				}
+			}
+			return p;
+		}();
+	}
+
+	// 後回しにした CreateSequence の本体をコンパイルする
+	// 本体が参照する(名前を含む)先に定義した Sequence の後の段にして、同じ段の Sequence を並列にコンパイルする
+	// 本体毎に別のアリーナを使う(EventArena はスレッドセーフではない)。エラーは定義順に CreateSequence の位置へ挿入する
+	static void compilePendingSequences(State& state) {
+		auto& pendings = state.pendingSequences;
+		if (pendings.empty()) return;
+
+		const auto refers = [](const std::string_view& mml, const std::string_view& name) {		// mml が name を単語として含むか
+			const auto isWord = [](char c) { return CharClass::is(c, CharClass::word); };
+			for (auto pos = mml.find(name); pos != std::string_view::npos; pos = mml.find(name, pos + 1)) {
+				const auto end = pos + name.size();
+				if ((pos == 0 || !isWord(mml[pos - 1])) && (end == mml.size() || !isWord(mml[end]))) return true;
+			}
+			return false;
+		};
+		std::vector<std::vector<size_t>> stages;		// 段毎の pendings のインデックス
+		std::vector<size_t> stageOf(pendings.size());
+		for (size_t i = 0; i < pendings.size(); i++) {
+			size_t stage = 0;
+			for (size_t j = 0; j < i; j++) {
+				if (stageOf[j] >= stage && refers(pendings[i].mml, pendings[j].sequence->name)) stage = stageOf[j] + 1;
+			}
+			stageOf[i] = stage;
+			if (stages.size() <= stage) stages.resize(stage + 1);
+			stages[stage].push_back(i);
+		}
+
+		Options options = state.options;
+		options.threads = 1;		// 入れ子の Sequence は並列にしない
+		std::vector<std::vector<Result::Error>> errors(pendings.size());
+		for (const auto& stage : stages) {
+			parallel::forEach(stage.size(), state.options.threads, [&](size_t n) {
+				const size_t i = stage[n];
+				auto& pending = pendings[i];
+				try {
+					const auto arena = std::make_shared<midi::EventArena>();
+					compileSequence(*pending.sequence, pending.mml, pending.scope, arena, options, errors[i]);
+				} catch (...) {
+					errors[i] = { { ErrorCode::createSequenceError, pending.text } };
+				}
+			});
+		}
+
+		for (size_t i = pendings.size(); i-- > 0;) {	// 後ろから挿入すれば前の errorIndex はずれない
+			state.errors.insert(state.errors.begin() + pendings[i].errorIndex, errors[i].begin(), errors[i].end());
+		}
+		pendings.clear();
+	}
+
+	static std::vector<Port> mmlToSequence(const std::string_view& targetMml, const Sequences& sequences, const Arena& arena, const Options& options) {
+		State state(sequences, arena, options);
+		state.deferSequences = parallel::resolveThreads(options.threads) > 1;
+		parse(state, targetMml, [](const std::string_view&) {});
+		compilePendingSequences(state);
 		if (state.errors.size() > 0) throw MmlException(std::move(state.errors));
 
 		std::vector<Port> ports; // Result result;
@@ -1598,25 +2047,15 @@ public:
 			ports.emplace_back(std::move(i.second.port));
 		}
 
-		// Sequence 展開
+		// Sequence 展開(イベントを共有するなら複製せずに参照する)
 		for (auto& i : state.pastedSequences) {
-			size_t postion = i.position;
-			auto& spSequence = i.sequence;
-			const size_t length = i.length ? *i.length : (std::numeric_limits<size_t>::max)();
-
-			for (auto& port : spSequence->ports) {
-				Port p;
-				p.name = port.name;
-				p.instrument = port.instrument;
-				p.channel = port.channel;
-
-				for (auto& event : port.eventList) {
-					auto sp = event.second->clone();
-					if (event.first >= length) break;			// length より後は採用しない
-					p.eventList.emplace(event.first + postion, sp);
+			for (auto& port : i.sequence->ports) {
+				if (options.shareEvents) {
+					auto& p = ports.emplace_back(Port{ .name = port.name, .instrument = port.instrument, .channel = port.channel });
+					p.paste = pasteView(i, port);
+				} else {
+					ports.emplace_back(paste(i, port, arena, options));
 				}
-
-				ports.emplace_back(std::move(p));
 			}
 		}
 
@@ -1626,169 +2065,387 @@ public:
 };
 
 MmlCompiler::Result MmlCompiler::compile(const std::shared_ptr<const std::string>& mml) {
+	return compile(mml, Options());
+}
+
+MmlCompiler::Result MmlCompiler::compile(const std::shared_ptr<const std::string>& mml, const Options& options) {
 	Result r{ mml };
 	try {
-		r.ports = Inner::mmlToSequence(*mml, MmlCompiler::Inner::Sequences());
+		r.arena = std::make_shared<midi::EventArena>();
+		r.ports = Inner::mmlToSequence(*mml, MmlCompiler::Inner::Sequences(), r.arena, options);
+
+		// 中間イベントのパース(全ポートの中間イベントを位置順に処理する)
+		// 貼り付けたポートは元のイベントを書き換えずに、置き換えるイベントを Port::Paste::replaced に持つ
+		struct EventInfo {
+			Port& port;
+			EventList::const_iterator itEvent;		// 貼り付けなら貼り付け元のイベント
+			size_t index;							// 貼り付け元のイベントの番号
+		};
+		std::multimap<size_t, EventInfo> events;
+		for (auto& port : r.ports) {
+			const auto& list = port.paste ? port.paste->source->eventList : port.eventList;
+			const auto offset = port.paste ? port.paste->offset : 0;
+			const auto end = port.paste ? list.lower_bound(port.paste->limit) : list.end();
+			size_t index = 0;
+			for (auto itEvent = list.begin(); itEvent != end; itEvent++, index++) {
+				if (itEvent->second->as<InterEvent>()) {
+					events.emplace(itEvent->first + offset, EventInfo{ port, itEvent, index });
+				}
+			}
+		}
+		Inner::Resolver resolver(r.arena);
+		for (auto& [position, event] : events) {
+			if (!event.port.paste) {
+				resolver.replace(event.port, event.itEvent);
+			} else {
+				event.port.paste->replaced.emplace_back(event.index, resolver.resolve(event.port, static_cast<const InterEvent&>(*event.itEvent->second)));
+			}
+		}
 
-		// 中間イベントのパース
-		struct Channel {
-			double expression = 127.0;	// エクスプレッション (0.0～127.0)
-			double volume = 100.0;		// ボリューム (0.0～127.0)
-			double pan = 64;			// パン (0.0～127.0)
-			double pitchBend = 0.0;		// ピッチベンド (-8192～8191)
-			double fineTune = 0.0;		// FineTune (-100.0～100.0)
-			double coarseTune = 0.0;	// coarseTune (-64.0～63.0)
+	} catch (MmlException& e) {
+		r.errors = e.errors;
+	}
+	return r;
+}
+
+class MmlCompiler::Session::Impl {
+public:
+	explicit Impl(const Options& options)
+		:m_options(options)
+	{}
+
+	const Result& update(const std::shared_ptr<const std::string>& mml) {
+		if (m_exposed) {				// 公開していたポートを戻す
+			m_ports = std::move(m_result.ports);
+			m_result.ports.clear();
+			m_exposed = false;
+		}
+		if (!m_state || m_arena->used() > m_rebuildThreshold) {		// 初回 or 編集を繰り返してアリーナが大きくなったら作り直す
+			rebuild(mml);
+		} else {
+			reparse(mml);
+		}
+
+		auto& state = *m_state;
+		m_result.mml = m_source;
+		m_result.arena = m_arena;
+		m_result.errors = state.errors;
+		if (state.errors.empty()) {		// エラーがあればポートは空(compile と同じ)
+			m_result.ports = std::move(m_ports);
+			m_exposed = true;
+		}
+		return m_result;
+	}
+
+	const Result& result() const {
+		return m_result;
+	}
+	size_t reparsedOffset() const {
+		return m_reparsedOffset;
+	}
+
+private:
+	// 行の先頭のコマンドの前のパーサーの状態
+	struct PortSnapshot {
+		Inner::PortInfo*			info;
+		size_t						position;
+		size_t						defaultStep;
+		int							octave;
+		double						velocity;
+		std::shared_ptr<EventNote>	beforeEvent;
+		size_t						beforeLength;		// beforeEvent の音長(後の ^ で書き換わる)
+		bool						noteUnmove;
+		EventList::iterator			last;				// 最後のイベント(イベントが無ければ end())
+	};
+	struct Checkpoint {
+		size_t						offset = 0;			// コマンドの先頭位置(ソース先頭からのバイト数)
+		std::vector<PortSnapshot>	ports;				// mapPort の順
+		Inner::PortInfo*			currentPort = nullptr;
+		std::shared_ptr<const Inner::Sequences>	sequences;
+		size_t						pastedSequences = 0;
+		size_t						errors = 0;			// それまでのエラー数(エラーがあるチェックポイントからは始めない)
+	};
+	struct Inter {			// 解決済みの中間イベント
+		size_t									port;	// m_ports のインデックス
+		std::shared_ptr<const InterEvent>		event;
+	};
+
+	// すべてパースし直す
+	void rebuild(const std::shared_ptr<const std::string>& mml) {
+		m_state.reset();
+		m_arena = std::make_shared<midi::EventArena>();
+		m_state.emplace(m_parentSequences, m_arena, m_options);
+		m_source = mml;
+		m_checkpoints.clear();
+		m_scanned = 0;
+		m_newLine = true;
+		m_reparsedOffset = 0;
+		parse(*m_source);
+		rebuildOutput();
+		m_rebuildThreshold = m_arena->used() * 4 + 1024 * 1024;
+	}
+
+	// 変更のあった行からパースし直す
+	void reparse(const std::shared_ptr<const std::string>& mml) {
+		const std::string_view oldText = *m_source;
+		const std::string_view newText = *mml;
+		const size_t diff = std::mismatch(oldText.begin(), oldText.end(), newText.begin(), newText.end()).first - oldText.begin();
+		if (diff == oldText.size() && diff == newText.size()) return;		// 変更ナシ
+
+		// 変更位置より前から始まる最後の行(そのコマンドからパースし直す。変更位置から始まるコマンドは直前のコマンドの一部になることがある)
+		// エラーになったコマンドは閉じていない文字列などで後ろの行まで読んでいることがあるので、エラーより後の行からは始めない
+		auto itCheckpoint = std::partition_point(m_checkpoints.begin(), m_checkpoints.end(), [&](const Checkpoint& cp) {
+			return cp.offset < diff && cp.errors == 0;
+		});
+		if (itCheckpoint == m_checkpoints.begin() || std::prev(itCheckpoint)->offset < newText.size() / 4) {	// ほとんどパースし直すなら作り直した方が速い
+			rebuild(mml);
+			return;
+		}
+		const Checkpoint cp = std::move(*std::prev(itCheckpoint));
+		m_checkpoints.erase(std::prev(itCheckpoint), m_checkpoints.end());
+
+		auto& state = *m_state;
+		size_t changed = (std::numeric_limits<size_t>::max)();	// イベントが変わる最初の位置
+		const auto change = [&](size_t position) {
+			changed = (std::min)(changed, position);
 		};
-		struct Instrument {
-			double masterVolume = 16383.0;	// マスターボリューム
-			std::map<uint8_t, Channel>	channels;	// <channelNo,Channel>
+
+		// チェックポイントの状態に戻す
+		bool portsChanged = false;		// ポートの増減(出力を作り直す)
+		auto itSnapshot = cp.ports.begin();
+		for (auto i = state.mapPort.begin(); i != state.mapPort.end();) {
+			if (itSnapshot == cp.ports.end() || itSnapshot->info != &i->second) {		// 後で作ったポート
+				i = state.mapPort.erase(i);
+				portsChanged = true;
+				continue;
+			}
+			const auto& snapshot = *itSnapshot++;
+			auto& info = i->second;
+			auto& list = info.port.eventList;
+			if (const auto first = next(list, snapshot.last); first != list.end()) {
+				change(first->first);
+				list.erase(first, list.end());
+			}
+			info.position = snapshot.position;
+			info.defaultStep = snapshot.defaultStep;
+			info.octave = snapshot.octave;
+			info.velocity = snapshot.velocity;
+			info.beforeEvent = snapshot.beforeEvent;
+			if (info.beforeEvent) info.beforeEvent->length = snapshot.beforeLength;
+			info.noteUnmove = snapshot.noteUnmove;
+			i++;
+		}
+		state.currentPort = cp.currentPort;
+		state.sequences = *cp.sequences;
+		state.createdSequences.resize(cp.sequences->size());		// Sequence は追加しかしないので、先頭からチェックポイントの数だけ残す
+		size_t keptPorts = state.mapPort.size();		// m_ports で残すポート数
+		auto itPasted = state.pastedSequences.begin();
+		for (size_t n = 0; n < cp.pastedSequences; n++, itPasted++) {
+			keptPorts += itPasted->sequence->ports.size();
+		}
+		for (auto i = itPasted; i != state.pastedSequences.end(); i++) {
+			change(i->position);
+		}
+		state.pastedSequences.erase(itPasted, state.pastedSequences.end());
+		assert(cp.errors == 0);
+		state.errors.clear();
+
+		// 残した string_view を新しいソースに付け替える(変更位置より前は同じ内容)
+		const auto rebase = [&](std::string_view& text) {
+			if (text.data() < oldText.data() || text.data() > oldText.data() + oldText.size()) return;
+			const size_t offset = text.data() - oldText.data();
+			assert(offset + text.size() <= diff);
+			text = newText.substr(offset, text.size());
 		};
-		struct State {
-			std::map<std::string_view, Instrument> instruments;		// <instrument名,Instrument>
-			double tempo = 120.0;			// テンポ
-		}state;
-
-		const auto events = [&] {
-			struct EventInfo {
-				State& state;
-				std::map<std::string_view, Instrument>::iterator itInstrument;
-				std::map<uint8_t, Channel>::iterator itChannel;
-				std::multimap<size_t, std::shared_ptr<const EventBase>>& eventList;
-				std::multimap<size_t, std::shared_ptr<const EventBase>>::iterator itEvent;
-			};
-			std::multimap<size_t, EventInfo> events;
-			for (auto& port : r.ports) {
-				const auto [itInstrument, isInsertedInstrument] = state.instruments.try_emplace(port.instrument);
-				const auto [itChannel, isInsertedChannel] = itInstrument->second.channels.try_emplace(port.channel);
-				for (auto itEvent = port.eventList.begin(); itEvent != port.eventList.end(); itEvent++) {
-					if (std::dynamic_pointer_cast<const Inner::InterEvent>(itEvent->second)) {
-						events.emplace(itEvent->first, EventInfo{ state, itInstrument, itChannel, port.eventList, itEvent });
-					}
-				}
+		for (auto i = state.mapPort.begin(); i != state.mapPort.end();) {
+			const auto next = std::next(i);
+			auto node = state.mapPort.extract(i);		// ノードごと付け替えるので PortInfo のアドレスは変わらない
+			rebase(node.key());
+			rebase(node.mapped().port.name);
+			rebase(node.mapped().port.instrument);
+			state.mapPort.insert(std::move(node));
+			i = next;
+		}
+		for (auto& sequence : state.createdSequences) {
+			for (auto& port : sequence->ports) {		// Sequence は共有しているので直接書き換える
+				rebase(port.name);
+				rebase(port.instrument);
 			}
-			return events;
-		}();
+		}
+		if (!portsChanged) {		// ポートが増減していれば出力は作り直すので付け替えない
+			for (size_t i = 0; i < keptPorts; i++) {
+				rebase(m_ports[i].name);
+				rebase(m_ports[i].instrument);
+			}
+		}
+		m_source = mml;
+
+		// パースし直す
+		m_scanned = cp.offset;
+		m_newLine = true;
+		m_reparsedOffset = cp.offset;
+		parse(newText.substr(cp.offset));
+
+		for (const auto& snapshot : cp.ports) {
+			const auto& list = snapshot.info->port.eventList;
+			if (const auto first = next(snapshot.info->port.eventList, snapshot.last); first != list.end()) {
+				change(first->first);
+			}
+		}
+		portsChanged |= state.mapPort.size() != cp.ports.size();
+		for (auto i = std::next(state.pastedSequences.begin(), cp.pastedSequences); i != state.pastedSequences.end(); i++) {
+			change(i->position);
+		}
 
-		for (auto& event : events) {
+		if (portsChanged) {
+			rebuildOutput();
+		} else if (changed != (std::numeric_limits<size_t>::max)()) {
+			patchOutput(changed, cp.pastedSequences, keptPorts);
+		}
+	}
 
-			static const std::map<std::type_index, void (*)(const decltype(events)::value_type&)> map = {
-				{typeid(Inner::InterPitchBend), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterPitchBend&>(*event.second.itEvent->second);
-					Channel& ch = event.second.itChannel->second;
-					ch.pitchBend = e.assign.apply(ch.pitchBend);
-					auto ev = std::make_shared<EventPitchBend>();
-					ev->pitchBend = std::clamp(static_cast<int>(std::lround(ch.pitchBend)), -8192, 8191);
-					event.second.itEvent->second = ev;		// Eventを置換
-				}},
-				{typeid(Inner::InterPan), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterPan&>(*event.second.itEvent->second);
-					Channel& ch = event.second.itChannel->second;
-					ch.pan = e.assign.apply(ch.pan);
-					auto ev = std::make_shared<EventControlChange>();
-					ev->no = static_cast<decltype(ev->no)>(midi::EventControlChange::Type::pan);
-					ev->value = std::clamp(static_cast<int>(std::lround(ch.pan)), 0, 127);
-					event.second.itEvent->second = ev;		// Eventを置換
-				}},
-				{typeid(Inner::InterExpression), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterExpression&>(*event.second.itEvent->second);
-					Channel& ch = event.second.itChannel->second;
-					ch.expression = e.assign.apply(ch.expression);
-					auto ev = std::make_shared<EventControlChange>();
-					ev->no = static_cast<decltype(ev->no)>(midi::EventControlChange::Type::expression);
-					ev->value = std::clamp(static_cast<int>(std::lround(ch.expression)), 0, 127);
-					event.second.itEvent->second = ev;		// Eventを置換
-				}},
-				{typeid(Inner::InterVolume), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterVolume&>(*event.second.itEvent->second);
-					Channel& ch = event.second.itChannel->second;
-					ch.volume = e.assign.apply(ch.volume);
-					auto ev = std::make_shared<EventControlChange>();
-					ev->no = static_cast<decltype(ev->no)>(midi::EventControlChange::Type::volume);
-					ev->value = std::clamp(static_cast<int>(std::lround(ch.volume)), 0, 127);
-					event.second.itEvent->second = ev;		// Eventを置換
-				}},
-				{typeid(Inner::InterFineTune), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterFineTune&>(*event.second.itEvent->second);
-					Channel& ch = event.second.itChannel->second;
-					ch.fineTune = e.assign.apply(ch.fineTune);
-					const auto toRaw = [](double fineTune) {
-						constexpr double inMin = -100.0, inMax = 100.0;
-						constexpr int outMax = 16383;
-						return std::clamp(static_cast<int>(std::round((fineTune - inMin) * (outMax + 1) / (inMax - inMin))), 0, outMax);	// -8192～0～8192 スケール(+100には微妙に届かない)
-					};
-					const auto raw = toRaw(ch.fineTune);
+	static EventList::iterator next(EventList& list, EventList::iterator last) {	// last の次のイベント
+		return last == list.end() ? list.begin() : std::next(last);
+	}
 
-					struct {
-						midi::EventControlChange::Type no;
-						uint8_t val;
-					}const tbl[] = {
-						{midi::EventControlChange::Type::rpnMSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::fineTune) / 0x80 & 0x7f	},
-						{midi::EventControlChange::Type::rpnLSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::fineTune) & 0x7f	},
-						{midi::EventControlChange::Type::dataEntryMSB,	static_cast<uint8_t>(raw / 0x80 & 0x7f)	},
-						{midi::EventControlChange::Type::dataEntryLSB,	static_cast<uint8_t>(raw & 0x7f)	},
-					};
-					for (auto& t : tbl) {
-						auto e = std::make_shared<EventControlChange>();
-						e->no = static_cast<decltype(e->no)>(t.no);
-						e->value = t.val;
-						event.second.eventList.emplace_hint(event.second.itEvent, event.second.itEvent->first, e);	// Eventを挿入
-					}
-					event.second.eventList.erase(event.second.itEvent);	// 不要になったEventを削除
-				}},
-				{typeid(Inner::InterCoarseTune), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterCoarseTune&>(*event.second.itEvent->second);
-					Channel& ch = event.second.itChannel->second;
-					ch.coarseTune = e.assign.apply(ch.coarseTune);
-					const int val = std::clamp(static_cast<int>(std::lround(ch.coarseTune)), -64, 63);
-					struct {
-						midi::EventControlChange::Type no;
-						uint8_t val;
-					}const tbl[] = {
-							{midi::EventControlChange::Type::rpnMSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::coarseTune) / 0x80 & 0x7f	},
-							{midi::EventControlChange::Type::rpnLSB,		static_cast<uint16_t>(midi::EventControlChange::RpnType::coarseTune) & 0x7f	},
-							{midi::EventControlChange::Type::dataEntryMSB,	static_cast<uint8_t>((val + 64) & 0x7f)	},
-							{midi::EventControlChange::Type::dataEntryLSB,	0	},
-					};
-					for (auto& t : tbl) {
-						auto e = std::make_shared<EventControlChange>();
-						e->no = static_cast<decltype(e->no)>(t.no);
-						e->value = t.val;
-						event.second.eventList.emplace_hint(event.second.itEvent, event.second.itEvent->first, e);	// Eventを挿入
-					}
-					event.second.eventList.erase(event.second.itEvent);	// 不要になったEventを削除
-				}},
-				{typeid(Inner::InterMasterVolume), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterMasterVolume&>(*event.second.itEvent->second);
-					Instrument& inst = event.second.itInstrument->second;
-					inst.masterVolume = e.assign.apply(inst.masterVolume);
-					auto ev = std::make_shared<EventSystemExclusive>();
-					midi::utility::Bit14 u(static_cast<uint16_t>(std::clamp(static_cast<int>(std::lround(inst.masterVolume)), 0, 16383)));
-					ev->data = { 0xf0, 0x7f, 0x7f, 0x04, 0x1, static_cast<uint8_t>(u.lsb), static_cast<uint8_t>(u.msb), 0xf7 };
-					event.second.itEvent->second = ev;		// Eventを置換
-				}},
-				{typeid(Inner::InterTempo), [](const decltype(events)::value_type& event) {
-					auto& e = static_cast<const Inner::InterTempo&>(*event.second.itEvent->second);
-					event.second.state.tempo = e.assign.apply(event.second.state.tempo);
-					assert(std::isfinite(event.second.state.tempo));
-					auto ev = std::make_shared<EventMeta>();
-					auto t = midi::EventMeta::createTempo(std::clamp(event.second.state.tempo, 1.0, 1000.0));	// createTempoを利用
-					ev->type = static_cast<decltype(ev->type)>(t.type);
-					ev->data = t.data;
-					event.second.itEvent->second = ev;		// Eventを置換
-				}},
+	void parse(const std::string_view& mml) {
+		Inner::parse(*m_state, mml, [&](const std::string_view& text) {
+			const size_t offset = text.data() - m_source->data();
+			if (!m_newLine) {
+				m_newLine = std::string_view(*m_source).substr(m_scanned, offset - m_scanned).find('\n') != std::string_view::npos;
+			}
+			m_scanned = offset;
+			if (!m_newLine) return;
+			m_newLine = false;
+			saveCheckpoint(offset);
+		});
+	}
 
-			};
+	void saveCheckpoint(size_t offset) {
+		const auto& state = *m_state;
+		Checkpoint cp{ .offset = offset };
+		cp.ports.reserve(state.mapPort.size());
+		for (auto& [name, info] : m_state->mapPort) {
+			auto& list = info.port.eventList;
+			cp.ports.emplace_back(PortSnapshot{
+				&info, info.position, info.defaultStep, info.octave, info.velocity,
+				info.beforeEvent, info.beforeEvent ? info.beforeEvent->length : 0, info.noteUnmove,
+				list.empty() ? list.end() : std::prev(list.end()),
+			});
+		}
+		cp.currentPort = state.currentPort;
+		if (!m_checkpoints.empty() && m_checkpoints.back().sequences->size() == state.sequences.size()) {
+			cp.sequences = m_checkpoints.back().sequences;		// Sequence は追加しかしないので、数が同じなら同じ
+		} else {
+			cp.sequences = std::make_shared<const Inner::Sequences>(state.sequences);
+		}
+		cp.pastedSequences = state.pastedSequences.size();
+		cp.errors = state.errors.size();
+		m_checkpoints.emplace_back(std::move(cp));
+	}
 
-			if (const auto i = map.find(typeid(*event.second.itEvent->second)); i != map.end()) {
-				(i->second)(event);
+	// 出力するポートを作り直す
+	void rebuildOutput() {
+		m_ports.clear();
+		for (const auto& [name, info] : m_state->mapPort) {
+			m_ports.emplace_back(info.port);
+		}
+		for (const auto& pasted : m_state->pastedSequences) {
+			for (const auto& port : pasted.sequence->ports) {
+				m_ports.emplace_back(Inner::paste(pasted, port, m_arena, m_options));
 			}
+		}
+		m_inters.clear();
+		resolve(0);
+	}
 
+	// 出力するポートの from 以降を作り直す
+	void patchOutput(size_t from, size_t keptPasted, size_t keptPorts) {
+		m_ports.erase(m_ports.begin() + keptPorts, m_ports.end());
+		auto itPort = m_ports.begin();
+		for (const auto& [name, info] : m_state->mapPort) {
+			auto& list = (itPort++)->eventList;
+			list.erase(list.lower_bound(from), list.end());
+			const auto& source = info.port.eventList;
+			for (auto i = source.lower_bound(from); i != source.end(); i++) {
+				list.emplace_hint(list.end(), *i);
+			}
+		}
+		auto itPasted = m_state->pastedSequences.begin();
+		for (size_t n = 0; n < keptPasted; n++, itPasted++) {
+			for (const auto& port : itPasted->sequence->ports) {
+				auto& p = *itPort++;
+				p.eventList.erase(p.eventList.lower_bound(from), p.eventList.end());
+				Inner::appendPasted(p, *itPasted, port, m_arena, m_options, from);
+			}
 		}
+		for (; itPasted != m_state->pastedSequences.end(); itPasted++) {
+			for (const auto& port : itPasted->sequence->ports) {
+				m_ports.emplace_back(Inner::paste(*itPasted, port, m_arena, m_options));
+			}
+		}
+		resolve(from);
+	}
 
-	} catch (MmlException& e) {
-		r.errors = e.errors;
+	// 中間イベントの from 以降を解決し直す(from より前の中間イベントは現在値の更新だけ行う)
+	void resolve(size_t from) {
+		m_inters.erase(m_inters.lower_bound(from), m_inters.end());
+		Inner::Resolver resolver(m_arena);
+		for (const auto& [position, inter] : m_inters) {
+			resolver.apply(m_ports[inter.port], *inter.event);
+		}
+
+		struct EventInfo {
+			size_t port;
+			EventList::iterator itEvent;
+		};
+		std::multimap<size_t, EventInfo> events;
+		for (size_t port = 0; port < m_ports.size(); port++) {
+			auto& list = m_ports[port].eventList;
+			for (auto itEvent = list.lower_bound(from); itEvent != list.end(); itEvent++) {
+				if (itEvent->second->as<InterEvent>()) {
+					events.emplace(itEvent->first, EventInfo{ port, itEvent });
+				}
+			}
+		}
+		for (auto& [position, event] : events) {
+			m_inters.emplace_hint(m_inters.end(), position, Inter{ event.port, std::static_pointer_cast<const InterEvent>(event.itEvent->second) });
+			resolver.replace(m_ports[event.port], event.itEvent);
+		}
 	}
-	return r;
+
+	const Options							m_options;
+	const Inner::Sequences					m_parentSequences;
+	Arena									m_arena;
+	std::optional<Inner::State>				m_state;			// パーサーの状態(ポートは中間イベントのまま)
+	std::shared_ptr<const std::string>		m_source;
+	std::vector<Checkpoint>					m_checkpoints;		// 行毎(行の最初のコマンドの前)の状態
+	size_t									m_scanned = 0;		// 改行を探した位置
+	bool									m_newLine = true;	// 次のコマンドの前で状態を保存する
+	size_t									m_reparsedOffset = 0;
+	size_t									m_rebuildThreshold = 0;
+	std::vector<Port>						m_ports;			// 出力するポート(中間イベントは解決済み)
+	std::multimap<size_t, Inter>			m_inters;			// 解決済みの中間イベント(<位置,Inter> 解決した順)
+	bool									m_exposed = false;	// m_ports を m_result.ports に移しているか
+	Result									m_result;
+};
+
+MmlCompiler::Session::Session()
+	:Session(Options())
+{}
+MmlCompiler::Session::Session(const Options& options)
+	:m_impl(std::make_unique<Impl>(options))
+{}
+MmlCompiler::Session::~Session() {}
+
+const MmlCompiler::Result& MmlCompiler::Session::update(const std::shared_ptr<const std::string>& mml) {
+	return m_impl->update(mml);
+}
+const MmlCompiler::Result& MmlCompiler::Session::result() const {
+	return m_impl->result();
+}
+size_t MmlCompiler::Session::reparsedOffset() const {
+	return m_impl->reparsedOffset();
 }
 
 std::optional<MmlCompiler::Util::ParsedWord> MmlCompiler::Util::parseWord(const std::string_view& text) {
@@ -1825,10 +2482,11 @@ std::optional<MmlCompiler::Util::ParsedWord> MmlCompiler::Util::parseWord(const
 	}
 
 	{// みなし文字列
-		static const auto re = regex(R"(^([a-zA-Z_][\w\+\-]*))");		// 頭文字は英字_ で英字数値_+- が対象
-		if (const auto m = regexSearch(text, re)) {
-			parsedWord.next = std::string_view((*m)[0].second, text.end());
-			parsedWord.word = std::string_view((*m)[0].first, (*m)[0].second);
+		// 頭文字は英字_ で英字数値_+- が対象
+		if (!text.empty() && (CharClass::is(text[0], CharClass::alpha) || text[0] == '_')) {
+			const size_t n = 1 + CharClass::count(text.substr(1), CharClass::wordSign);
+			parsedWord.next = text.substr(n);
+			parsedWord.word = text.substr(0, n);
 			return parsedWord;
 		}
 	}
@@ -2010,4 +2668,39 @@ void MmlCompiler::unitTest() {
 		}
 	}
 
+	{// Session (インクリメンタルコンパイルの結果が compile と同じこと)
+		std::cout << "Session" << std::endl;
+		const auto dump = [](const Result& r) {		// ポートとイベントを文字列にする
+			std::ostringstream os;
+			os << r.getText(r.errors) << "\n";
+			for (const auto& port : r.ports) {
+				os << port.name << "," << port.instrument << "," << int(port.channel) << "\n";
+				port.forEachEvent([&](size_t position, const std::shared_ptr<const EventBase>& event) {
+					os << position << ":" << typeid(*event).name();
+					if (auto e = std::dynamic_pointer_cast<const EventNote>(event)) os << "," << int(e->note) << "," << e->length << "," << int(e->velocity);
+					if (auto e = std::dynamic_pointer_cast<const EventControlChange>(event)) os << "," << int(e->no) << "," << int(e->value);
+					os << "\n";
+				});
+			}
+			return os.str();
+		};
+		const std::string head =
+			"CreateSequence(name:s1, mml:\"CreatePort(name:a, channel:1) l8 c d e f g a b\")\n"
+			"CreateSequence(name:s2, mml:\"CreatePort(name:b, channel:2) V(+=1) c2 d2\")\n"
+			"CreatePort(name:d, channel:3)\n"
+			"Seq(s1) Seq(s2) Seq(s1) Seq(s1,length:\"16\") Seq(s2)\n";
+		static const std::initializer_list<std::string> edits = {	// 順に update する
+			"port(d) V(+=10) c Seq(s1)\n",
+			"port(d) V(+=11) c Seq(s1)\n",			// length 指定の貼り付けより後を変更
+			"port(d) V(+=11) c Seq(s1,length:\"4\")\n",
+			"port(d) V(+=11) c Seq(s3)\n",			// エラー
+			"port(d) V(+=11) c Seq(s2)\n",
+		};
+		Session session;
+		for (const auto& edit : edits) {
+			const auto mml = head + edit;
+			assert(dump(session.update(mml)) == dump(compile(mml)));
+		}
+	}
+
 }
@@ -1,6 +1,7 @@
 ﻿#pragma once
 
 #include <cstdint>
+#include <limits>
 #include <map>
 #include <memory>
 #include <optional>
@@ -9,6 +10,8 @@
 #include <variant>
 #include <vector>
 
+#include "EventArena.h"
+
 namespace rlib::sequencer {
 
 	class MmlCompiler {
@@ -16,43 +19,90 @@ namespace rlib::sequencer {
 	public:
 		static constexpr int timeBase = 480;			// 分解能(4分音符あたりのカウント)
 	
+		using Arena = std::shared_ptr<midi::EventArena>;	// イベントのメモリアリーナ(nullptr:通常のヒープ)
+
+		struct EventNote;
+		struct EventProgramChange;
+		struct EventPitchBend;
+		struct EventControlChange;
+		struct EventMeta;
+		struct EventSystemExclusive;
+		struct InterEvent;		// 中間イベント(コンパイル中だけ使い、結果には残らない。定義は MmlCompiler.cpp)
+
+		// 具象イベントへの参照(RTTI を使わずに std::visit で振り分けるため)
+		using EventRef = std::variant<
+			const EventNote*,
+			const EventProgramChange*,
+			const EventPitchBend*,
+			const EventControlChange*,
+			const EventMeta*,
+			const EventSystemExclusive*,
+			const InterEvent*
+		>;
+
 		struct EventBase {
 			virtual ~EventBase() {}
-			virtual std::shared_ptr<EventBase> clone()const = 0;
+			virtual EventRef ref() const = 0;		// 具象イベントへの参照
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const = 0;	// arena に複製する
+
+			// 具象イベントの型で f を呼ぶ(f(const EventNote&) 等)
+			template <typename F> decltype(auto) visit(F&& f) const {
+				return std::visit([&f](const auto* p) -> decltype(auto) {return f(*p); }, ref());
+			}
+			template <typename T> const T* as() const {		// 型が T なら参照を返す(dynamic_cast の代わり)
+				const auto r = ref();
+				const auto p = std::get_if<const T*>(&r);
+				return p ? *p : nullptr;
+			}
 		};
 
 		struct EventSystemExclusive : public EventBase {
 			std::vector<uint8_t>	data;
-			virtual std::shared_ptr<EventBase> clone()const {
-				return std::make_shared<EventSystemExclusive>(*this);
+			virtual EventRef ref() const {
+				return this;
+			}
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const {
+				return midi::allocateShared<EventSystemExclusive>(arena, *this);
 			}
 		};
 
 		struct EventMeta : public EventBase {
 			uint8_t type = 0;
 			std::vector<uint8_t> data;
-			virtual std::shared_ptr<EventBase> clone()const {
-				return std::make_shared<EventMeta>(*this);
+			virtual EventRef ref() const {
+				return this;
+			}
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const {
+				return midi::allocateShared<EventMeta>(arena, *this);
 			}
 		};
 
 		struct EventProgramChange : public EventBase {
 			uint8_t	programNo = 0;
-			virtual std::shared_ptr<EventBase> clone()const {
-				return std::make_shared<EventProgramChange>(*this);
+			virtual EventRef ref() const {
+				return this;
+			}
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const {
+				return midi::allocateShared<EventProgramChange>(arena, *this);
 			}
 		};
 		struct EventPitchBend : public EventBase {
 			int16_t	pitchBend = 0;
-			virtual std::shared_ptr<EventBase> clone()const {
-				return std::make_shared<EventPitchBend>(*this);
+			virtual EventRef ref() const {
+				return this;
+			}
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const {
+				return midi::allocateShared<EventPitchBend>(arena, *this);
 			}
 		};
 		struct EventControlChange : public EventBase {		// 注:個別イベントに当てはまらないControlChangeがコレに該当する
 			uint8_t	no = 0;				// コントロールNo 0～127
 			uint8_t	value = 0;			// 値 0～127
-			virtual std::shared_ptr<EventBase> clone()const {
-				return std::make_shared<EventControlChange>(*this);
+			virtual EventRef ref() const {
+				return this;
+			}
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const {
+				return midi::allocateShared<EventControlChange>(arena, *this);
 			}
 		};
 
@@ -60,16 +110,53 @@ namespace rlib::sequencer {
 			uint8_t	note = 0;			// ノート番号 0～127
 			size_t	length = 0;			// 音長(ステップ数)
 			uint8_t	velocity = 0;		// ベロシティ(0～127)
-			virtual std::shared_ptr<EventBase> clone()const {
-				return std::make_shared<EventNote>(*this);
+			virtual EventRef ref() const {
+				return this;
+			}
+			virtual std::shared_ptr<EventBase> clone(const Arena& arena)const {
+				return midi::allocateShared<EventNote>(arena, *this);
 			}
 		};
 
+		using EventList = midi::ArenaMultimap<size_t, std::shared_ptr<const EventBase>>;	// <position,Event>
+
 		struct Port {
 			std::string_view	name;			// name
 			std::string_view	instrument;		// instrument
 			uint8_t	channel = 0;		// チャンネル
-			std::multimap<size_t, std::shared_ptr<const EventBase>>	eventList;	// <position,Event>
+			EventList			eventList;		// <position,Event>(paste があれば使わない)
+
+			// Sequence の貼り付け(貼り付け元のポートのイベントを複製せずに参照する)
+			struct Paste {
+				std::shared_ptr<const Port>	source;			// 貼り付け元のポート(paste は持たない)
+				size_t	offset = 0;							// 貼り付け位置(source の位置に足す)
+				size_t	limit = (std::numeric_limits<size_t>::max)();	// source の位置が limit 未満のイベントだけ使う
+				std::vector<std::pair<size_t, std::vector<std::shared_ptr<const EventBase>>>>	replaced;	// <source のイベントの番号,置き換えるイベント> 番号順(中間イベントを解決した結果)
+			};
+			std::optional<Paste>	paste;
+
+			// イベントを位置順に f(position, event) で列挙する(貼り付けなら置き換えたイベントを使う)
+			template <typename F> void forEachEvent(F&& f) const {
+				if (!paste) {
+					for (const auto& [position, event] : eventList) f(position, event);
+					return;
+				}
+				const auto& list = paste->source->eventList;
+				auto itReplaced = paste->replaced.begin();
+				size_t n = 0;
+				for (auto i = list.begin(), end = list.lower_bound(paste->limit); i != end; i++, n++) {
+					if (itReplaced != paste->replaced.end() && itReplaced->first == n) {
+						for (const auto& e : (itReplaced++)->second) f(i->first + paste->offset, e);
+					} else {
+						f(i->first + paste->offset, i->second);
+					}
+				}
+			}
+			size_t eventCount() const {		// イベント数(中間イベントの置き換え前)
+				if (!paste) return eventList.size();
+				const auto& list = paste->source->eventList;
+				return std::distance(list.begin(), list.lower_bound(paste->limit));
+			}
 		};
 		using Event = decltype(Port::eventList)::value_type;
 
@@ -141,6 +228,7 @@ namespace rlib::sequencer {
 
 		struct Result {
 			std::shared_ptr<const std::string>	mml;	// コンパイルソース(std::string_view の参照元 MML)
+			Arena				arena;	// ports のイベントを確保したメモリアリーナ(arena->size() が大きさ)
 			std::vector<Port>	ports;
 			struct Error {
 				ErrorCode			code;
@@ -153,10 +241,47 @@ namespace rlib::sequencer {
 			std::string getText(const std::vector<Error>& errors) const;
 			std::string getJson(const std::vector<Error>& errors) const;
 		};
+
+		// コンパイルオプション
+		struct Options {
+			bool	shareEvents = true;		// 同じ内容のイベントはインスタンスを共有する(Sequence の貼り付けは Port::paste で参照する。mmlToSmf でも同じ MIDI イベントを共有する)
+			size_t	threads = 1;			// CreateSequence の本体のコンパイルに使うスレッド数(0:ハードウェアのスレッド数) 2以上なら本体を Seq で参照されるまで後回しにして、互いに参照しない Sequence を並列にコンパイルする
+		};
 		static Result compile(const std::shared_ptr<const std::string>& mml);
+		static Result compile(const std::shared_ptr<const std::string>& mml, const Options& options);
 		static Result compile(const std::string& mml) {
 			return compile(std::make_shared<const std::string>(mml));
 		}
+		static Result compile(const std::string& mml, const Options& options) {
+			return compile(std::make_shared<const std::string>(mml), options);
+		}
+
+		// インクリメンタルコンパイル(エディタで編集する毎の再コンパイル用)
+		// 前回のソースと先頭から比較して、最初に変更のあった行からパースし直す(結果は compile と同じ)
+		// 各行の先頭のコマンドの前でパーサーの状態(ポートの位置・オクターブ・デフォルト音長・ベロシティ等)を保存しておき、
+		// 変更位置より後のイベント・Sequence の貼り付け・中間イベントの解決だけをやり直す
+		// エラーのある行があればその行より前からパースし直す(エラーになったコマンドは後ろの行まで読んでいることがある)
+		// スレッドセーフではない
+		class Session {
+		public:
+			Session();
+			explicit Session(const Options& options);
+			~Session();
+			Session(const Session&) = delete;
+			Session& operator=(const Session&) = delete;
+
+			// mml をコンパイルする(戻り値は次の update まで有効。前回の結果のイベントは書き換わることがある)
+			const Result& update(const std::shared_ptr<const std::string>& mml);
+			const Result& update(const std::string& mml) {
+				return update(std::make_shared<const std::string>(mml));
+			}
+			const Result& result() const;
+			size_t reparsedOffset() const;		// 直前の update でパースし直した位置(ソース先頭からのバイト数)
+
+		private:
+			class Impl;
+			std::unique_ptr<Impl>	m_impl;
+		};
 
 
 		struct Util {
@@ -1,8 +1,8 @@
 ﻿#pragma once
 
-#include <typeindex>
-#include <typeinfo>
+#include <cassert>
 
+#include "EventInterner.h"
 #include "MmlCompiler.h"
 #include "Smf.h"
 
@@ -13,55 +13,66 @@ namespace rlib::sequencer {
 		MmlCompiler::Result	mmlResult;
 		bool hasError() const { return mmlResult.errors.size() > 0; };
 	};
-	inline Result mmlToSmf(const std::string& mml) {
-		Result r;
+
+	// コンパイル結果(Session::update の結果でもよい)から Smf を作る。イベントは arena に確保する
+	inline midi::Smf mmlToSmf(const MmlCompiler::Result& mmlResult, const MmlCompiler::Options& options, const MmlCompiler::Arena& arena) {
 		using Smf = midi::Smf;
-		r.mmlResult = MmlCompiler::compile(mml);
-		if (r.hasError()) return r;
-		for (const auto& port : r.mmlResult.ports) {
-			Smf::Track track;
+		Smf smf;
+		midi::EventInterner interner(arena, options.shareEvents);	// 同じ内容のチャンネルメッセージは全トラックで共有する
+		for (const auto& port : mmlResult.ports) {
+			Smf::TrackBuilder track(arena);		// NoteOff は位置順にならないので最後にまとめて並べ替える
+			track.reserve(port.eventCount() * 2 + 2);
 
-			track.events.emplace(Smf::Event(0, std::make_shared<midi::EventMeta>(midi::EventMeta::createText(midi::EventMeta::Type::sequenceName, std::string(port.name)))));
+			track.add(0, midi::allocateShared<midi::EventMeta>(arena, midi::EventMeta::createText(midi::EventMeta::Type::sequenceName, std::string(port.name))));
 			if (!port.instrument.empty()) {
-				track.events.emplace(Smf::Event(0, std::make_shared<midi::EventMeta>(midi::EventMeta::createText(midi::EventMeta::Type::instrumentName, std::string(port.instrument)))));
+				track.add(0, midi::allocateShared<midi::EventMeta>(arena, midi::EventMeta::createText(midi::EventMeta::Type::instrumentName, std::string(port.instrument))));
 			}
 
-			for (const auto& event : port.eventList) {
-				static const std::map<std::type_index, void (*)(Smf::Track&, const MmlCompiler::Port&, const MmlCompiler::Event&)> map = {
-					{typeid(MmlCompiler::EventNote), [](Smf::Track& track,const MmlCompiler::Port& port,const MmlCompiler::Event& event) {
-						auto& e = static_cast<const MmlCompiler::EventNote&>(*event.second);
-						track.events.insert(Smf::Event(event.first, std::make_shared<midi::EventNoteOn>(port.channel, e.note, e.velocity)));
-						track.events.insert(Smf::Event(event.first + e.length, std::make_shared<midi::EventNoteOff>(port.channel, e.note, 0)));
-					}},
-					{typeid(MmlCompiler::EventProgramChange), [](Smf::Track& track,const MmlCompiler::Port& port,const MmlCompiler::Event& event) {
-						auto& e = static_cast<const MmlCompiler::EventProgramChange&>(*event.second);
-						track.events.insert(Smf::Event(event.first, std::make_shared<midi::EventProgramChange>(port.channel, e.programNo)));
-					}},
-					{typeid(MmlCompiler::EventPitchBend), [](Smf::Track& track,const MmlCompiler::Port& port,const MmlCompiler::Event& event) {
-						auto& e = static_cast<const MmlCompiler::EventPitchBend&>(*event.second);
-						track.events.insert(Smf::Event(event.first, std::make_shared<midi::EventPitchBend>(port.channel, e.pitchBend)));
-					}},
-					{typeid(MmlCompiler::EventControlChange), [](Smf::Track& track,const MmlCompiler::Port& port,const MmlCompiler::Event& event) {
-						auto& e = static_cast<const MmlCompiler::EventControlChange&>(*event.second);
-						track.events.insert(Smf::Event(event.first, std::make_shared<midi::EventControlChange>(port.channel, e.no, e.value)));
-					}},
-					{typeid(MmlCompiler::EventMeta), [](Smf::Track& track,const MmlCompiler::Port& port,const MmlCompiler::Event& event) {
-						auto& e = static_cast<const MmlCompiler::EventMeta&>(*event.second);
-						track.events.insert(Smf::Event(event.first, std::make_shared<midi::EventMeta>(static_cast<midi::EventMeta::Type>(e.type), std::move(std::vector<uint8_t>(e.data)))));
-					}},
-					{typeid(MmlCompiler::EventSystemExclusive), [](Smf::Track& track,const MmlCompiler::Port& port,const MmlCompiler::Event& event) {
-						auto& e = static_cast<const MmlCompiler::EventSystemExclusive&>(*event.second);
-						track.events.insert(Smf::Event(event.first, std::make_shared<midi::EventSystemExclusive>(e.data)));
-					}},
-				};
-				const auto& ev = *event.second;
-				if (auto i = map.find(typeid(ev)); i != map.end()) {
-					(i->second)(track, port, event);
-				} else assert(false);
-			}
-			r.smf.tracks.emplace_back(std::move(track));
+			port.forEachEvent([&](size_t position, const std::shared_ptr<const MmlCompiler::EventBase>& event) {
+				event->visit(midi::utility::Overloaded{
+					[&](const MmlCompiler::EventNote& e) {
+						track.add(position, interner.get(midi::message::NoteOn{ port.channel, e.note, e.velocity }));
+						track.add(position + e.length, interner.get(midi::message::NoteOff{ port.channel, e.note, 0 }));
+					},
+					[&](const MmlCompiler::EventProgramChange& e) {
+						track.add(position, interner.get(midi::message::ProgramChange{ port.channel, e.programNo }));
+					},
+					[&](const MmlCompiler::EventPitchBend& e) {
+						track.add(position, interner.get(midi::message::PitchBend{ port.channel, e.pitchBend }));
+					},
+					[&](const MmlCompiler::EventControlChange& e) {
+						track.add(position, interner.get(midi::message::ControlChange{ port.channel, e.no, e.value }));
+					},
+					[&](const MmlCompiler::EventMeta& e) {
+						track.add(position, midi::allocateShared<midi::EventMeta>(arena, static_cast<midi::EventMeta::Type>(e.type), e.data));
+					},
+					[&](const MmlCompiler::EventSystemExclusive& e) {
+						track.add(position, midi::allocateShared<midi::EventSystemExclusive>(arena, e.data));
+					},
+					[](const MmlCompiler::InterEvent&) {
+						assert(false);		// 中間イベントはコンパイル時に MIDI イベントへ置き換え済み
+					},
+				});
+			});
+			smf.tracks.emplace_back(track.build());
 		}
-		return r;
+		return smf;
+	}
+	inline midi::Smf mmlToSmf(const MmlCompiler::Result& mmlResult, const MmlCompiler::Options& options) {
+		return mmlToSmf(mmlResult, options, std::make_shared<midi::EventArena>());	// Session のアリーナは編集の度に使い回すので別にする
+	}
+	inline midi::Smf mmlToSmf(const MmlCompiler::Result& mmlResult) {
+		return mmlToSmf(mmlResult, MmlCompiler::Options());
+	}
+
+	inline Result mmlToSmf(const std::string& mml, const MmlCompiler::Options& options) {
+		auto mmlResult = MmlCompiler::compile(mml, options);
+		if (!mmlResult.errors.empty()) return Result{ midi::Smf(), std::move(mmlResult) };
+		auto smf = mmlToSmf(mmlResult, options, mmlResult.arena);		// SMF のイベントもコンパイル結果と同じアリーナに確保する
+		return Result{ std::move(smf), std::move(mmlResult) };
+	}
+	inline Result mmlToSmf(const std::string& mml) {
+		return mmlToSmf(mml, MmlCompiler::Options());
 	}
 
 }
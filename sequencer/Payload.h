@@ -0,0 +1,165 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace rlib::midi {
+
+	// SysEx/メタイベントのデータ(変更不可のバイト列)
+	// ・16Byte以下は内部に持つ(テンポ・拍子・調号等のメタイベントはヒープを使わない)
+	// ・それより大きいものはヒープに確保し、複製(コピー)しても共有する
+	// ・共有の入力バッファ(メモリマップしたファイル等)の一部をコピーせずに参照できる(borrow)
+	// 先頭の数バイトを内部に、残りを入力バッファに持つ(SysEx のステータスバイト + 入力バッファ上のデータ)ことがあるので、連続領域とは限らない
+	class Payload {
+	public:
+		static constexpr size_t inlineCapacity = 16;
+
+		class const_iterator {
+		public:
+			using iterator_category = std::random_access_iterator_tag;
+			using value_type = uint8_t;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const uint8_t*;
+			using reference = uint8_t;
+
+			const_iterator() {}
+			const_iterator(const Payload* payload, size_t index)
+				:m_payload(payload)
+				, m_index(index)
+			{}
+			uint8_t operator*() const {
+				return (*m_payload)[m_index];
+			}
+			uint8_t operator[](difference_type n) const {
+				return (*m_payload)[m_index + n];
+			}
+			const_iterator& operator++() { m_index++; return *this; }
+			const_iterator operator++(int) { auto t = *this; m_index++; return t; }
+			const_iterator& operator--() { m_index--; return *this; }
+			const_iterator operator--(int) { auto t = *this; m_index--; return t; }
+			const_iterator& operator+=(difference_type n) { m_index += n; return *this; }
+			const_iterator& operator-=(difference_type n) { m_index -= n; return *this; }
+			friend const_iterator operator+(const_iterator i, difference_type n) { return i += n; }
+			friend const_iterator operator+(difference_type n, const_iterator i) { return i += n; }
+			friend const_iterator operator-(const_iterator i, difference_type n) { return i -= n; }
+			friend difference_type operator-(const const_iterator& a, const const_iterator& b) {
+				return static_cast<difference_type>(a.m_index) - static_cast<difference_type>(b.m_index);
+			}
+			bool operator==(const const_iterator& b) const { return m_index == b.m_index; }
+			auto operator<=>(const const_iterator& b) const { return m_index <=> b.m_index; }
+		private:
+			const Payload*	m_payload = nullptr;
+			size_t			m_index = 0;
+		};
+
+		Payload() {}
+		Payload(std::span<const uint8_t> bytes)					// コピーする
+			:Payload({}, bytes)
+		{}
+		Payload(const std::vector<uint8_t>& v)
+			:Payload(std::span<const uint8_t>(v))
+		{}
+		Payload(std::vector<uint8_t>&& v) {						// 16Byteより大きければ v の領域をそのまま使う
+			if (v.size() <= inlineCapacity) {
+				setHead(v);
+				return;
+			}
+			const auto p = std::make_shared<const std::vector<uint8_t>>(std::move(v));
+			m_body = *p;
+			m_owner = p;
+		}
+		Payload(std::initializer_list<uint8_t> bytes)
+			:Payload(std::span<const uint8_t>(bytes.begin(), bytes.size()))
+		{}
+		Payload(std::span<const uint8_t> head, std::span<const uint8_t> body) {	// head + body をコピーする
+			const size_t size = head.size() + body.size();
+			if (size <= inlineCapacity) {
+				setHead(head);
+				std::copy(body.begin(), body.end(), m_head.begin() + m_headSize);
+				m_headSize = static_cast<uint8_t>(size);
+				return;
+			}
+			auto p = std::make_shared<std::vector<uint8_t>>();
+			p->reserve(size);
+			p->insert(p->end(), head.begin(), head.end());
+			p->insert(p->end(), body.begin(), body.end());
+			m_body = *p;
+			m_owner = std::move(p);
+		}
+
+		// owner が保持しているバッファの body をコピーせずに参照する(owner は参照している間保持する)
+		// head(16Byte以下) はコピーして先頭に置く。全体が16Byte以下ならすべてコピーする
+		static Payload borrow(std::shared_ptr<const void> owner, std::span<const uint8_t> body, std::span<const uint8_t> head = {}) {
+			assert(head.size() <= inlineCapacity);
+			if (!owner || head.size() + body.size() <= inlineCapacity) return Payload(head, body);
+			Payload r;
+			r.setHead(head);
+			r.m_body = body;
+			r.m_owner = std::move(owner);
+			r.m_borrowed = true;
+			return r;
+		}
+
+		size_t size() const {
+			return m_headSize + m_body.size();
+		}
+		bool empty() const {
+			return size() == 0;
+		}
+		uint8_t operator[](size_t index) const {
+			return index < m_headSize ? m_head[index] : m_body[index - m_headSize];
+		}
+		uint8_t front() const {
+			return (*this)[0];
+		}
+		const_iterator begin() const {
+			return const_iterator(this, 0);
+		}
+		const_iterator end() const {
+			return const_iterator(this, size());
+		}
+		bool isBorrowed() const {		// 入力バッファを参照しているか
+			return m_borrowed;
+		}
+
+		// p へ offset 以降をコピーする(戻り値:書き込んだ次の位置)
+		uint8_t* copyTo(uint8_t* p, size_t offset = 0) const {
+			if (offset < m_headSize) {
+				p = std::copy(m_head.begin() + offset, m_head.begin() + m_headSize, p);
+				offset = m_headSize;
+			}
+			return std::copy(m_body.begin() + (offset - m_headSize), m_body.end(), p);
+		}
+		std::vector<uint8_t> toVector() const {
+			std::vector<uint8_t> v(size());
+			copyTo(v.data());
+			return v;
+		}
+
+		bool operator==(const Payload& b) const {
+			return size() == b.size() && std::equal(begin(), end(), b.begin());
+		}
+
+	private:
+		void setHead(std::span<const uint8_t> head) {
+			std::copy(head.begin(), head.end(), m_head.begin());
+			m_headSize = static_cast<uint8_t>(head.size());
+		}
+
+		std::array<uint8_t, inlineCapacity>	m_head{};		// 内部に持つ先頭部分
+		uint8_t								m_headSize = 0;
+		bool								m_borrowed = false;
+		std::span<const uint8_t>			m_body;			// ヒープ or 入力バッファ上の残りの部分
+		std::shared_ptr<const void>			m_owner;		// m_body の保持者
+	};
+
+}
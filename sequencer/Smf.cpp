@@ -5,13 +5,30 @@
 
 #include <array>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <istream>
 #include <iostream>
 #include <math.h>
+#include <numeric>
 #include <sstream>
+#include <tuple>
 #include <format>
 
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "./EventInterner.h"
 #include "./Smf.h"
+#include "../parallel/Parallel.h"
 
 using namespace rlib;
 using namespace rlib::midi;
@@ -40,301 +57,661 @@ namespace {
 		std::reverse(reinterpret_cast<uint8_t*>(&t), reinterpret_cast<uint8_t*>(&t) + sizeof(t));
 	}
 
-	class Read {
-		size_t m_readBytes = 0;
+	// メモリ上のバイト列の読み込み
+	class Cursor {
+		const uint8_t* m_p;
+		const uint8_t* m_end;
 	public:
-		std::istream& is;
-		Read(std::istream& is_)
-			:is(is_) {
+		Cursor(std::span<const uint8_t> data)
+			:m_p(data.data())
+			, m_end(data.data() + data.size())
+		{}
+		size_t remain() const {
+			return m_end - m_p;
 		}
-		const size_t readBytes()const {
-			return m_readBytes;
+		bool empty() const {
+			return m_p >= m_end;
 		}
 		template <typename T> T read() {
 			typename std::remove_const<T>::type buf;
-			if (is.read(reinterpret_cast<char*>(&buf), sizeof(buf)).gcount() < sizeof(buf)) {
+			if (remain() < sizeof(buf)) {
 				throw std::runtime_error("size error");
 			}
-			m_readBytes += sizeof(buf);
+			std::memcpy(&buf, m_p, sizeof(buf));
+			m_p += sizeof(buf);
 			return buf;
 		}
+		uint8_t readByte() {
+			if (m_p >= m_end) throw std::runtime_error("size error");
+			return *m_p++;
+		}
 
-		std::vector<uint8_t> read(size_t bytes) {
-			std::vector<uint8_t> buf(bytes);
-			if (bytes > 0) {
-				const auto readSize = is.read(reinterpret_cast<char*>(buf.data()), buf.size()).gcount();
-				m_readBytes += readSize;
-				buf.resize(readSize);
-			}
-			return buf;
+		// 指定バイト数を読む(足りなければ読めた分だけ)
+		std::span<const uint8_t> read(size_t bytes) {
+			const std::span<const uint8_t> result(m_p, (std::min)(bytes, remain()));
+			m_p += result.size();
+			return result;
 		}
 
 		void unget() {
-			if (!is.unget()) throw std::runtime_error("unget error");	// 1Byte戻す
-			m_readBytes--;
+			m_p--;	// 1Byte戻す
+		}
+
+		const uint8_t* position() const {
+			return m_p;
+		}
+
+		// 可変長数値を読む
+		uint64_t readVariableValue() {
+			const auto vv = utility::decodeVariableValue(m_p, m_end);
+			if (vv.size == 0) throw std::runtime_error("size error");
+			m_p += vv.size;
+			return vv.value;
 		}
 
 	};
-};
 
+	// ファイルのメモリマップ(マップできない環境では読み込んで保持する)
+	class MappedFile {
+		std::span<const uint8_t>	m_data;
+		std::vector<uint8_t>		m_buffer;		// マップしなかった場合の読み込み先
+#if defined(_WIN32)
+		HANDLE	m_file = INVALID_HANDLE_VALUE;
+		HANDLE	m_mapping = nullptr;
+#elif !defined(__EMSCRIPTEN__)
+		void*	m_address = MAP_FAILED;
+#endif
+	public:
+		MappedFile(const std::filesystem::path& path) {
+#if defined(_WIN32)
+			m_file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE) throw std::runtime_error("input file open error.");
+			LARGE_INTEGER size;
+			if (::GetFileSizeEx(m_file, &size) && size.QuadPart > 0) {
+				m_mapping = ::CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (m_mapping) {
+					if (const void* p = ::MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) {
+						m_data = { static_cast<const uint8_t*>(p), static_cast<size_t>(size.QuadPart) };
+						return;
+					}
+				}
+			}
+#elif !defined(__EMSCRIPTEN__)
+			const int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::runtime_error("input file open error.");
+			struct stat st;
+			if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+				m_address = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			}
+			::close(fd);
+			if (m_address != MAP_FAILED) {
+				m_data = { static_cast<const uint8_t*>(m_address), static_cast<size_t>(st.st_size) };
+				return;
+			}
+#endif
+			std::ifstream fs(path, std::ios::in | std::ios::binary);
+			if (fs.fail()) throw std::runtime_error("input file open error.");
+			m_buffer.assign(std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>());
+			m_data = m_buffer;
+		}
+		~MappedFile() {
+#if defined(_WIN32)
+			if (m_mapping && !m_buffer.data() && m_data.data()) ::UnmapViewOfFile(m_data.data());
+			if (m_mapping) ::CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE) ::CloseHandle(m_file);
+#elif !defined(__EMSCRIPTEN__)
+			if (m_address != MAP_FAILED) ::munmap(m_address, m_data.size());
+#endif
+		}
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
 
-std::vector<uint8_t> Smf::getFileImage() const
-{
-	std::list<std::vector<uint8_t>> trackData;
+		std::span<const uint8_t> data() const {
+			return m_data;
+		}
+	};
+};
 
-	for (auto& track : tracks) {
-		std::vector<uint8_t> v;
 
-		size_t position = 0;		// 現在位置
+namespace {
 
-		auto fEvent = [&](const Event& event) {
+	const midi::EventMeta endOfTrack = midi::EventMeta::createEndOfTrack();
 
-			{// DeltaTime
-				assert(event.first >= position);
-				const size_t deltaTime = event.first - position;		// DeltaTime
-				position = event.first;									// 現在位置更新
-				std::vector<uint8_t> s = midi::utility::getVariableValue(deltaTime);
-				v.insert(v.end(), std::make_move_iterator(s.begin()), std::make_move_iterator(s.end()));
+	// 末尾に EndOfTrack を付ける必要があるか
+	bool needsEndOfTrack(const Smf::Track& track) {
+		if (auto i = track.events().rbegin(); i != track.events().rend()) {		// 末尾が EndOfTrack ではないなら
+			if (auto meta = i->second->as<midi::EventMeta>()) {
+				if (meta->type == midi::EventMeta::Type::endOfTrack) {
+					return false;
+				}
 			}
+		}
+		return true;
+	}
 
-			{
-				std::vector<uint8_t> t = event.second->smfBytes();
-				v.insert(v.end(), std::make_move_iterator(t.begin()), std::make_move_iterator(t.end()));
+	// ランニングステータス (WriteOptions::runningStatus)
+	class RunningStatus {
+		uint8_t m_status = 0;	// 直前のチャンネルメッセージのステータス(0:なし)
+	public:
+		// エンコード済みのイベント(先頭がステータスバイト)に適用し、出力を開始する位置を返す
+		//	・NoteOff はベロシティ0の NoteOn に置き換える
+		//	・直前と同じステータスならステータスバイトを省略する
+		//	・SysEx/Meta の後はランニングステータスを解除する(読み込み側の runningStatus.beforeF のチェックに合わせる)
+		uint8_t* apply(uint8_t* p) {
+			if (*p >= 0xf0) {
+				m_status = 0;
+				return p;
 			}
+			if ((*p & 0xf0) == midi::EventNoteOff::statusByte) {
+				*p = static_cast<uint8_t>(midi::EventNoteOn::statusByte | (*p & 0x0f));
+				p[2] = 0;		// velocity
+			}
+			if (*p == m_status) return p + 1;
+			m_status = *p;
+			return p;
+		}
+	};
 
+	// トラックのイベント列をエンコード(バイト列は fWrite(const uint8_t*, size_t) へ出力)
+	template <typename F> void encodeTrack(const Smf::Track& track, const Smf::WriteOptions& options, F&& fWrite) {
+		size_t position = 0;		// 現在位置
+		RunningStatus runningStatus;
+
+		std::array<uint8_t, 32> buf;	// 作業領域(通常のイベントはここに収まる)
+		std::vector<uint8_t> largeBuf;	// 作業領域に収まらない SysEx/Meta 用(トラック内で使い回す)
+
+		auto fEvent = [&](size_t eventPosition, const midi::Event& event) {
+			uint8_t* p = buf.data();
+
+			// DeltaTime
+			assert(eventPosition >= position);
+			p = midi::utility::writeVariableValue(eventPosition - position, p);
+			position = eventPosition;									// 現在位置更新
+
+			const size_t eventSize = event.encodedSize();
+			if (static_cast<size_t>(buf.end() - p) >= eventSize) {
+				const auto end = event.encode(p);
+				if (options.runningStatus) {
+					const auto begin = runningStatus.apply(p);
+					p = std::copy(begin, end, p);		// 省略したステータスバイトの分を詰める
+				} else {
+					p = end;
+				}
+				fWrite(buf.data(), p - buf.data());
+			} else {						// SysEx/Meta
+				fWrite(buf.data(), p - buf.data());
+				largeBuf.resize(eventSize);
+				event.encode(largeBuf.data());
+				if (options.runningStatus) runningStatus.apply(largeBuf.data());
+				fWrite(largeBuf.data(), largeBuf.size());
+			}
 		};
 
-		for (auto& event : track.events) {
-			fEvent(event);
+		for (auto& event : track.events()) {
+			fEvent(event.first, *event.second);
 		}
 
 		// EndOfTrackがなければ付ける
-		[&] {
-			if (auto i = track.events.rbegin(); i != track.events.rend()) {		// 末尾が EndOfTrack ではないなら
-				if (auto meta = std::dynamic_pointer_cast<const midi::EventMeta>(i->second)) {
-					if (meta->type == midi::EventMeta::Type::endOfTrack) {
-						return;
-					}
-				}
-			}
-			Event e(position, std::make_shared<midi::EventMeta>(midi::EventMeta::createEndOfTrack()));
-			fEvent(e);
-		}();
+		if (needsEndOfTrack(track)) {
+			fEvent(position, endOfTrack);
+		}
+	}
 
-		{// TrackChunk を先頭に挿入
-			TrackChunk trackChunk;
-			trackChunk.dataLength = static_cast<uint32_t>(v.size());
-			changeEndian(trackChunk.dataLength);
-			v.insert(v.begin(),
-				reinterpret_cast<const uint8_t*>(&trackChunk),
-				reinterpret_cast<const uint8_t*>(&trackChunk) + sizeof(trackChunk));
+	// トラックのデータ長を算出(書き出し前のサイズ計算パス)
+	uint32_t getTrackDataLength(const Smf::Track& track, const Smf::WriteOptions& options) {
+		if (options.runningStatus) {		// 省略されるステータスバイトはイベントの並びで決まるので、実際にエンコードして数える
+			size_t size = 0;
+			encodeTrack(track, options, [&size](const uint8_t*, size_t n) { size += n; });
+			return static_cast<uint32_t>(size);
 		}
 
-		trackData.emplace_back(std::move(v));
+		size_t size = 0;
+		size_t position = 0;
+		for (auto& [eventPosition, event] : track.events()) {
+			size += midi::utility::getVariableValueSize(eventPosition - position) + event->encodedSize();
+			position = eventPosition;
+		}
+		if (needsEndOfTrack(track)) {
+			size += midi::utility::getVariableValueSize(0) + endOfTrack.encodedSize();
+		}
+		return static_cast<uint32_t>(size);
+	}
+
+	std::vector<uint32_t> getTrackDataLengths(const Smf& smf, const Smf::WriteOptions& options) {
+		std::vector<uint32_t> result;
+		result.reserve(smf.tracks.size());
+		for (auto& track : smf.tracks) {
+			result.push_back(getTrackDataLength(track, options));
+		}
+		return result;
 	}
 
-	const HeaderChunk headerChunk = [&] {
+	// SMFヘッダ作成
+	HeaderChunk makeHeaderChunk(const Smf& smf) {
 		HeaderChunk h;
-		h.trackCount = static_cast<uint16_t>(trackData.size());
+		h.trackCount = static_cast<uint16_t>(smf.tracks.size());
 		h.format = h.trackCount > 1 ? 1 : 0;
-		h.division = timeBase;
+		h.division = smf.timeBase;
 		// エンディアン変更
 		changeEndian(h.dataLength);
 		changeEndian(h.format);
 		changeEndian(h.trackCount);
 		changeEndian(h.division);
 		return h;
-	}();
+	}
+
+	// トラックチャンクのヘッダ出力
+	template <typename F> void writeTrackChunk(uint32_t dataLength, F&& fWrite) {
+		TrackChunk trackChunk;
+		trackChunk.dataLength = dataLength;
+		changeEndian(trackChunk.dataLength);
+		fWrite(reinterpret_cast<const uint8_t*>(&trackChunk), sizeof(trackChunk));
+	}
+
+	// SMFデータ出力(各バイトは fWrite(const uint8_t*, size_t) へ一度だけ出力する)
+	template <typename F> void writeFileImage(const Smf& smf, const Smf::WriteOptions& options, const std::vector<uint32_t>& trackDataLengths, F&& fWrite) {
+		assert(trackDataLengths.size() == smf.tracks.size());
 
-	std::vector<uint8_t> result(
-		reinterpret_cast<const uint8_t*>(&headerChunk),
-		reinterpret_cast<const uint8_t*>(&headerChunk) + sizeof(headerChunk));
+		const HeaderChunk headerChunk = makeHeaderChunk(smf);
+		fWrite(reinterpret_cast<const uint8_t*>(&headerChunk), sizeof(headerChunk));
 
-	for (auto& i : trackData) {
-		result.insert(result.end(), std::make_move_iterator(i.begin()), std::make_move_iterator(i.end()));
+		auto itLength = trackDataLengths.begin();
+		for (auto& track : smf.tracks) {
+			writeTrackChunk(*itLength++, fWrite);
+			encodeTrack(track, options, fWrite);
+		}
+	}
+
+	// FNV-1a(64bit) 8Byte単位で処理する(変更の判別用なのでバイト単位の FNV-1a とは値が異なってよい)
+	uint64_t fnv1a(std::span<const uint8_t> data) {
+		constexpr uint64_t prime = 0x100000001b3;
+		uint64_t h = 0xcbf29ce484222325 ^ data.size();
+		size_t i = 0;
+		for (; i + 8 <= data.size(); i += 8) {
+			uint64_t w;
+			std::memcpy(&w, data.data() + i, sizeof(w));
+			h = (h ^ w) * prime;
+		}
+		for (; i < data.size(); i++) {
+			h = (h ^ data[i]) * prime;
+		}
+		return h;
+	}
+
+	// トラックをエンコードしてメモリ上に作る
+	std::shared_ptr<const Smf::Track::Encoded> encodeTrackData(const Smf::Track& track, const Smf::WriteOptions& options) {
+		auto r = std::make_shared<Smf::Track::Encoded>();
+		r->runningStatus = options.runningStatus;
+		auto& v = r->data;
+		if (!options.runningStatus) v.reserve(getTrackDataLength(track, options));
+		encodeTrack(track, options, [&v](const uint8_t* p, size_t n) {
+			v.insert(v.end(), p, p + n);
+		});
+		r->hash = fnv1a(v);
+		return r;
 	}
 
+	// トラック毎にエンコード(結果はトラック順)
+	// options.cache ならトラックのキャッシュを使い、変更のあったトラックだけをエンコードする。スレッド数が2以上なら並列でエンコードする
+	std::vector<std::shared_ptr<const Smf::Track::Encoded>> encodeTracks(const Smf& smf, const Smf::WriteOptions& options) {
+		std::vector<const Smf::Track*> tracks;
+		tracks.reserve(smf.tracks.size());
+		for (auto& track : smf.tracks) tracks.push_back(&track);
+
+		std::vector<std::shared_ptr<const Smf::Track::Encoded>> result(tracks.size());
+		parallel::forEach(tracks.size(), options.threads, [&](size_t i) {
+			result[i] = options.cache ? tracks[i]->encoded(options) : encodeTrackData(*tracks[i], options);
+		});
+		return result;
+	}
+
+	// エンコード済みのトラックを連結して出力
+	template <typename F> void writeEncodedTracks(const Smf& smf, const std::vector<std::shared_ptr<const Smf::Track::Encoded>>& trackData, F&& fWrite) {
+		assert(trackData.size() == smf.tracks.size());
+
+		const HeaderChunk headerChunk = makeHeaderChunk(smf);
+		fWrite(reinterpret_cast<const uint8_t*>(&headerChunk), sizeof(headerChunk));
+
+		for (auto& encoded : trackData) {
+			const auto& v = encoded->data;
+			writeTrackChunk(static_cast<uint32_t>(v.size()), fWrite);
+			fWrite(v.data(), v.size());
+		}
+	}
+
+}
+
+
+std::shared_ptr<const Smf::Track::Encoded> Smf::Track::encoded(const WriteOptions& options) const
+{
+	auto& encoded = m_encoded[options.runningStatus];
+	if (!encoded) {
+		encoded = encodeTrackData(*this, options);
+	}
+	return encoded;
+}
+
+std::vector<uint8_t> Smf::getFileImage() const
+{
+	return getFileImage(WriteOptions());
+}
+
+std::vector<uint8_t> Smf::getFileImage(const WriteOptions& options) const
+{
+	std::vector<uint8_t> result;
+	const auto fWrite = [&result](const uint8_t* p, size_t n) {
+		result.insert(result.end(), p, p + n);
+	};
+
+	if (options.cache || (parallel::resolveThreads(options.threads) > 1 && tracks.size() > 1)) {
+		const auto trackData = encodeTracks(*this, options);
+		result.reserve(std::accumulate(trackData.begin(), trackData.end(), sizeof(HeaderChunk), [](size_t n, const auto& encoded) {
+			return n + sizeof(TrackChunk) + encoded->data.size();
+		}));
+		writeEncodedTracks(*this, trackData, fWrite);
+		return result;
+	}
+
+	const auto trackDataLengths = getTrackDataLengths(*this, options);
+	const size_t size = std::accumulate(trackDataLengths.begin(), trackDataLengths.end(), sizeof(HeaderChunk) + sizeof(TrackChunk) * trackDataLengths.size());
+	result.reserve(size);
+	writeFileImage(*this, options, trackDataLengths, fWrite);
+	assert(result.size() == size);
+
 	return result;
 }
 
-Smf Smf::fromStream(std::istream& is) {
-	using namespace midi;
+void Smf::write(std::ostream& os) const
+{
+	write(os, WriteOptions());
+}
 
-	Smf smf;
-	Read file(is);
+void Smf::write(std::ostream& os, const WriteOptions& options) const
+{
+	const auto fWrite = [&os](const uint8_t* p, size_t n) {
+		os.write(reinterpret_cast<const char*>(p), n);
+	};
 
-	const auto headerChunk = [&file]() {
-		HeaderChunk c = file.read<decltype(c)>();
-		if (c.MThd != HeaderChunk().MThd) {
-			throw std::runtime_error("MThd chunk error");
-		}
-		changeEndian(c.dataLength);
-		changeEndian(c.format);
-		changeEndian(c.trackCount);
-		changeEndian(c.division);
-		return c;
-	}();
+	if (options.cache || (parallel::resolveThreads(options.threads) > 1 && tracks.size() > 1)) {
+		writeEncodedTracks(*this, encodeTracks(*this, options), fWrite);
+		return;
+	}
 
-	smf.timeBase = headerChunk.division;
+	const auto trackDataLengths = getTrackDataLengths(*this, options);
+	writeFileImage(*this, options, trackDataLengths, fWrite);
+}
+
+TrackReader::TrackReader(std::span<const uint8_t> trackData)
+	:TrackReader(trackData, std::clog)
+{}
+
+TrackReader::TrackReader(std::span<const uint8_t> trackData, std::ostream& log)
+	:m_p(trackData.data())
+	, m_end(trackData.data() + trackData.size())
+	, m_log(&log)
+{}
+
+std::optional<TrackReader::Item> TrackReader::next() {
+	Cursor tr({ m_p, m_end });
 
-	// トラックチャンク
-	std::exception_ptr ep;	// 例外保持
 	try {
-		for (size_t i = 0; i < headerChunk.trackCount; i++) {
-			const auto trackChunk = [&file]() {
-				TrackChunk c = file.read<decltype(c)>();
-				if (c.MTrk != TrackChunk().MTrk) {
-					throw std::runtime_error("MTrk chunk error.");
+		while (!tr.empty()) {
+			m_position += tr.readVariableValue();		// 現在位置 += デルタタイム
+
+			// status 読み込み
+			const auto status = [&] {
+				const uint8_t status = tr.read<decltype(status)>();
+				if (!(status & 0x80)) {					// status 省略なら直前値を採用
+					tr.unget();							// 1Byte戻す
+					if (m_beforeF >= 0xf0) {	// 仕様違反チェック
+						*m_log << "[warning] running status transition after SysEx/Meta. recovery with previous status " << std::format("0x{:02x}", m_before & 0xf0) << std::endl;
+						m_beforeF = m_before;
+						return m_before;
+					}
+					return m_before;
 				}
-				changeEndian(c.dataLength);
-				return c;
+				m_beforeF = status;
+				if (status < 0xf0) m_before = status;
+				return status;
 			}();
 
-			const auto trackBinary = [&]() {
-				auto v = file.read(trackChunk.dataLength);
-				if (v.size() < trackChunk.dataLength) std::clog << "[warning] track data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
-				return std::string(v.begin(), v.end());
-			}();
-			std::istringstream iss(trackBinary);
-			Read tr(iss);
-
-			Smf::Track track;
-			try {
-				std::uint64_t currentPosition = 0;		// 現在位置
-
-				struct {
-					uint8_t before = 0;	// 直前のステータス(0x80～0xef)
-					uint8_t beforeF = 0;	// 直前のステータス(0x80～0xff) 違反チェック用
-				}runningStatus;
-
-				while (tr.readBytes() < trackBinary.size()) {
-					auto readVariableValue = [&tr] {					// 可変長数値を取得
-						return utility::readVariableValue([&] {return tr.read<uint8_t>(); });
-					};
-
-					currentPosition += readVariableValue();		// 現在位置 += デルタタイム
-
-					// status 読み込み
-					const auto status = [&] {
-						const uint8_t status = tr.read<decltype(status)>();
-						if (!(status & 0x80)) {					// status 省略なら直前値を採用
-							tr.unget();							// 1Byte戻す
-							if (runningStatus.beforeF >= 0xf0) {	// 仕様違反チェック
-								std::clog << "[warning] running status transition after SysEx/Meta. recovery with previous status " << std::format("0x{:02x}", runningStatus.before & 0xf0) << std::endl;
-								runningStatus.beforeF = runningStatus.before;
-								return runningStatus.before;
-							}
-							return runningStatus.before;
-						}
-						runningStatus.beforeF = status;
-						if (status < 0xf0) runningStatus.before = status;
-						return status;
-					}();
-
-					switch (status & 0xf0) {
-					case EventNoteOff::statusByte: {
-						const std::array<uint8_t, 2> a = tr.read<decltype(a)>();
-						track.events.emplace(currentPosition, std::make_shared<EventNoteOff>(status & 0xf, a[0] & 0x7f, a[1] & 0x7f));
-						break;
-					}
-					case EventNoteOn::statusByte: {
-						const std::array<uint8_t, 2> a = tr.read<decltype(a)>();
-						track.events.emplace(currentPosition, std::make_shared<EventNoteOn>(status & 0xf, a[0] & 0x7f, a[1] & 0x7f));
-						break;
-					}
-					case EventPolyphonicKeyPressure::statusByte: {
-						const std::array<uint8_t, 2> a = tr.read<decltype(a)>();
-						track.events.emplace(currentPosition, std::make_shared<EventPolyphonicKeyPressure>(status & 0xf, a[0] & 0x7f, a[1] & 0x7f));
-						break;
-					}
-					case EventControlChange::statusByte: {
-						const std::array<uint8_t, 2> a = tr.read<decltype(a)>();
-						track.events.emplace(currentPosition, std::make_shared<EventControlChange>(status & 0xf, a[0] & 0x7f, a[1] & 0x7f));
-						break;
-					}
-					case EventProgramChange::statusByte: {
-						const uint8_t n = tr.read<decltype(n)>();
-						track.events.emplace(currentPosition, std::make_shared<EventProgramChange>(status & 0xf, n & 0x7f));
-						break;
-					}
-					case EventPitchBend::statusByte: {
-						const std::array<uint8_t, 2> a = tr.read<decltype(a)>();
-						const auto n = ((a[0] & 0x7f) + (a[1] & 0x7f) * 0x80) - 8192;
-						track.events.emplace(currentPosition, std::make_shared<EventPitchBend>(status & 0xf, n));
-						break;
-					}
-					case EventChannelPressure::statusByte: {
-						const uint8_t n = tr.read<decltype(n)>();
-						track.events.emplace(currentPosition, std::make_shared<EventChannelPressure>(status & 0xf, n & 0x7f));
-						break;
-					}
-					default:
-						switch (status) {
-						case EventSystemExclusive::statusByteF0:
-						case EventSystemExclusive::statusByteF7: {
-							const auto len = readVariableValue();		// データ長
-							std::vector<uint8_t> v{ status };
-							const auto data = tr.read(len);
-							if (data.size() < len) std::clog << "[warning] system exclusive data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
-							v.insert(v.end(), data.begin(), data.end());
-							track.events.emplace(currentPosition, std::make_shared<EventSystemExclusive>(std::move(v)));
-							break;
-						}
-						case EventMeta::statusByte: {
-							const uint8_t type = tr.read<decltype(type)>();						// イベントタイプ
-							const auto len = readVariableValue();		// データ長
-							auto data = tr.read(len);
-							if (data.size() < len) std::clog << "[warning] meta data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
-							const auto spEvent = std::make_shared<EventMeta>(static_cast<EventMeta::Type>(type), std::move(data));
-							track.events.emplace(currentPosition, spEvent);
-
-							if (spEvent->type == EventMeta::Type::endOfTrack) { // End of Track が現れたら当該トラックの残りデータは無視
-								tr.read(trackChunk.dataLength - tr.readBytes());
-							}
-							break;
-						}
-
-						case 0xf1:	// MIDI Time Code Quarter Frame
-						case 0xf2:	// Song Position Pointer
-						case 0xf3:	// Song Select
-						case 0xf4:	// Reserved
-						case 0xf5:	// Reserved
-						case 0xf6:	// Tune Request
-						// case 0xf7:	// End of Exclusive
-						case 0xf8:	// Timing Clock
-						case 0xf9:	// Reserved
-						case 0xfa:	// Start
-						case 0xfb:	// Continue
-						case 0xfc:	// Stop
-						case 0xfd:	// Reserved
-						case 0xfe:	// Active Sense
-						// case 0xff:	// System Reset
-							break;		// これらは無視する。1バイトイベントとして次へ。
-						default:
-							throw std::runtime_error("unknown status byte");
-							break;
-						}
+			EventView view{ status };
+			switch (status & 0xf0) {
+			case EventNoteOff::statusByte:
+			case EventNoteOn::statusByte:
+			case EventPolyphonicKeyPressure::statusByte:
+			case EventControlChange::statusByte:
+			case EventPitchBend::statusByte: {
+				const auto p = tr.position();
+				tr.read<std::array<uint8_t, 2>>();
+				view.data = { p, 2 };
+				break;
+			}
+			case EventProgramChange::statusByte:
+			case EventChannelPressure::statusByte: {
+				const auto p = tr.position();
+				tr.read<uint8_t>();
+				view.data = { p, 1 };
+				break;
+			}
+			default:
+				switch (status) {
+				case EventSystemExclusive::statusByteF0:
+				case EventSystemExclusive::statusByteF7: {
+					const auto len = tr.readVariableValue();		// データ長
+					view.data = tr.read(len);
+					if (view.data.size() < len) *m_log << "[warning] system exclusive data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
+					break;
+				}
+				case EventMeta::statusByte: {
+					view.metaType = tr.read<uint8_t>();						// イベントタイプ
+					const auto len = tr.readVariableValue();		// データ長
+					view.data = tr.read(len);
+					if (view.data.size() < len) *m_log << "[warning] meta data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
+					if (static_cast<EventMeta::Type>(view.metaType) == EventMeta::Type::endOfTrack) { // End of Track が現れたら当該トラックの残りデータは無視
+						tr.read(tr.remain());
 					}
+					break;
 				}
-			} catch (...) {
-				if (track.events.size() > 0) {
-					smf.tracks.emplace_back(std::move(track));
+
+				case 0xf1:	// MIDI Time Code Quarter Frame
+				case 0xf2:	// Song Position Pointer
+				case 0xf3:	// Song Select
+				case 0xf4:	// Reserved
+				case 0xf5:	// Reserved
+				case 0xf6:	// Tune Request
+				// case 0xf7:	// End of Exclusive
+				case 0xf8:	// Timing Clock
+				case 0xf9:	// Reserved
+				case 0xfa:	// Start
+				case 0xfb:	// Continue
+				case 0xfc:	// Stop
+				case 0xfd:	// Reserved
+				case 0xfe:	// Active Sense
+				// case 0xff:	// System Reset
+					continue;	// これらは無視する。1バイトイベントとして次へ。
+				default:
+					throw std::runtime_error("unknown status byte");
+					break;
 				}
-				throw;
 			}
-			smf.tracks.emplace_back(std::move(track));
+			m_p = tr.position();
+			return Item{ m_position, view };
 		}
 	} catch (...) {
-		ep = std::current_exception();
+		m_p = m_end;		// 壊れたデータの続きは読まない
+		throw;
 	}
-	if (ep) {
+	m_p = tr.position();
+	return std::nullopt;
+}
+
+namespace {
+
+	// トラックデータ(MTrk のデータ部)のデコード
+	// 例外発生時も track にはそれまでにデコードしたイベントが残る。警告は log へ出力
+	// owner(trackData の参照先を保持しているオブジェクト)を指定すると、SysEx/メタのデータはコピーせずに参照する
+	void decodeTrack(std::span<const uint8_t> trackData, Smf::Track& track, bool intern, const std::shared_ptr<const void>& owner, std::ostream& log) {
+		TrackReader reader(trackData, log);
+		EventInterner interner(track.arena(), intern);		// 同じ内容のチャンネルメッセージはトラック内で共有する
+		auto& events = track.mutableEvents();
+		while (const auto item = reader.next()) {
+			const auto& view = item->event;
+			auto event = view.isChannelMessage() ? interner.get(view) : view.toEvent(track.arena(), owner);
+			events.emplace_hint(events.end(), item->position, std::move(event));	// 位置は単調増加なので末尾に追加
+		}
+	}
+
+	// 例外を警告として出力する
+	void warnException(const std::exception_ptr& ep, std::ostream& log = std::clog) {
 		try {
 			std::rethrow_exception(ep);
 		} catch (const std::exception& e) {
-			std::clog << "[warning] exception: " << e.what() << std::endl;
+			log << "[warning] exception: " << e.what() << std::endl;
+		} catch (...) {
+			log << "[warning] exception unknwon" << std::endl;
+		}
+	}
+
+	// ヘッダチャンク読み込み
+	HeaderChunk readHeaderChunk(Cursor& file) {
+		HeaderChunk c = file.read<decltype(c)>();
+		if (c.MThd != HeaderChunk().MThd) {
+			throw std::runtime_error("MThd chunk error");
+		}
+		changeEndian(c.dataLength);
+		changeEndian(c.format);
+		changeEndian(c.trackCount);
+		changeEndian(c.division);
+		return c;
+	}
+
+	// トラックチャンク(デコード前)
+	struct TrackChunkData {
+		std::span<const uint8_t>	data;
+		bool						truncated = false;	// データ長に対してデータが足りない
+	};
+
+	// トラックチャンクの境界を列挙する(デコードはしない)
+	// 途中でチャンクが壊れていた場合はそれまでの分を返し、例外を scanError に保持する
+	std::vector<TrackChunkData> scanTrackChunks(Cursor& file, size_t trackCount, std::exception_ptr& scanError) {
+		std::vector<TrackChunkData> chunks;
+		chunks.reserve(trackCount);
+		try {
+			for (size_t i = 0; i < trackCount; i++) {
+				const auto trackChunk = [&file]() {
+					TrackChunk c = file.read<decltype(c)>();
+					if (c.MTrk != TrackChunk().MTrk) {
+						throw std::runtime_error("MTrk chunk error.");
+					}
+					changeEndian(c.dataLength);
+					return c;
+				}();
+				const auto data = file.read(trackChunk.dataLength);
+				chunks.push_back({ data, data.size() < trackChunk.dataLength });
+			}
 		} catch (...) {
-			std::clog << "[warning] exception unknwon" << std::endl;
+			scanError = std::current_exception();
+		}
+		return chunks;
+	}
+
+	// トラックチャンクの境界を列挙する(遅延読み込み用)
+	// 壊れたチャンクがあっても、それまでに読めたトラックがあれば警告して続行する(Smf::fromMemory と同様)
+	std::vector<TrackChunkData> indexTrackChunks(Cursor& file, size_t trackCount, std::ostream& log = std::clog) {
+		std::exception_ptr scanError;
+		auto chunks = scanTrackChunks(file, trackCount, scanError);
+		if (scanError) {
+			warnException(scanError, log);
+			if (chunks.empty()) std::rethrow_exception(scanError);
+		}
+		return chunks;
+	}
+
+	// トラック毎のデコード結果
+	struct DecodedTrack {
+		Smf::Track			track;
+		std::string			log;		// 警告(ファイル順に出力するため溜めておく)
+		std::exception_ptr	error;
+	};
+
+	// トラックのアリーナの初期サイズ(1イベントは最小2Byte、アリーナ上では multimap のノード込みで 32～100Byte 程度)
+	size_t arenaInitialSize(const TrackChunkData& chunk) {
+		return (std::max<size_t>)(chunk.data.size() * 16, 256);
+	}
+
+	// トラックチャンクを1つデコードする
+	void decodeTrackChunk(const TrackChunkData& chunk, bool intern, const std::shared_ptr<const void>& owner, DecodedTrack& decoded, std::ostream& log) {
+		if (chunk.truncated) log << "[warning] track data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
+		try {
+			decodeTrack(chunk.data, decoded.track, intern, owner, log);
+		} catch (...) {
+			decoded.error = std::current_exception();
+		}
+	}
+
+}
+
+Smf Smf::fromMemory(std::span<const uint8_t> data) {
+	return fromMemory(data, ReadOptions());
+}
+
+Smf Smf::fromMemory(std::span<const uint8_t> data, const ReadOptions& options) {
+	return fromMemory(nullptr, data, options);
+}
+
+Smf Smf::fromMemory(const std::shared_ptr<const void>& owner, std::span<const uint8_t> data, const ReadOptions& options) {
+	Smf smf;
+	Cursor file(data);
+
+	const auto headerChunk = readHeaderChunk(file);
+
+	smf.timeBase = headerChunk.division;
+
+	// トラックチャンク
+	// 先にチャンク境界を確定させてからデコードし、結果はファイル順に組み立てる
+	std::exception_ptr scanError;
+	const auto chunks = scanTrackChunks(file, headerChunk.trackCount, scanError);
+
+	std::ostream& log = options.log ? *options.log : std::clog;		// 警告の出力先
+	const auto& payloadOwner = options.borrowPayload ? owner : nullptr;	// SysEx/メタのデータの参照先(nullptr:コピーする)
+	std::vector<DecodedTrack> decoded(chunks.size());
+	if (options.arena) {
+		for (size_t i = 0; i < decoded.size(); i++) {		// デコードはトラック毎に並列に行うのでアリーナもトラック毎
+			decoded[i].track = Track(std::make_shared<EventArena>(arenaInitialSize(chunks[i])));
 		}
+	}
+	const auto threads = (std::min)(parallel::resolveThreads(options.threads), chunks.size());
+	const bool concurrent = threads > 1;
+	if (concurrent) {
+		parallel::forEach(chunks.size(), threads, [&](size_t i) {
+			std::ostringstream log;
+			decodeTrackChunk(chunks[i], options.intern, payloadOwner, decoded[i], log);
+			decoded[i].log = log.str();
+		});
+	}
+
+	std::exception_ptr ep;	// 例外保持
+	for (size_t i = 0; i < decoded.size(); i++) {
+		auto& d = decoded[i];
+		if (concurrent) {
+			log << d.log;
+		} else {
+			decodeTrackChunk(chunks[i], options.intern, payloadOwner, d, log);
+		}
+		if (d.error) {
+			if (d.track.events().size() > 0) {	// 例外発生までにデコードできた分は残す
+				smf.tracks.emplace_back(std::move(d.track));
+			}
+			ep = d.error;
+			break;
+		}
+		smf.tracks.emplace_back(std::move(d.track));
+	}
+	if (!ep) ep = scanError;
+
+	if (ep) {
+		warnException(ep, log);
 		if (smf.tracks.size() <= 0) {	// トラックがまったくパースできてない状態なら
 			std::rethrow_exception(ep);	// throw で終了
 		}
@@ -342,17 +719,295 @@ Smf Smf::fromStream(std::istream& is) {
 	return smf;
 }
 
+Smf Smf::fromStream(std::istream& is) {
+	return fromStream(is, ReadOptions());
+}
+
+Smf Smf::fromStream(std::istream& is, const ReadOptions& options) {
+	std::vector<uint8_t> data;
+	for (std::array<char, 64 * 1024> buf; is.read(buf.data(), buf.size()) || is.gcount() > 0;) {
+		data.insert(data.end(), buf.data(), buf.data() + is.gcount());
+	}
+	const auto storage = std::make_shared<const std::vector<uint8_t>>(std::move(data));	// SysEx/メタのデータが参照するので保持しておく
+	return fromMemory(storage, *storage, options);
+}
+
+Smf Smf::fromFile(const std::filesystem::path& path) {
+	return fromFile(path, ReadOptions());
+}
+
+Smf Smf::fromFile(const std::filesystem::path& path, const ReadOptions& options) {
+	const auto file = std::make_shared<const MappedFile>(path);		// SysEx/メタのデータが参照するので保持しておく
+	return fromMemory(file, file->data(), options);
+}
+
+LazySmf::LazySmf(std::shared_ptr<const void> storage, std::span<const uint8_t> data, const Smf::ReadOptions& options)
+	:m_storage(std::move(storage))
+	, m_data(data)
+	, m_options(options)
+{
+	Cursor file(m_data);
+	const auto headerChunk = readHeaderChunk(file);
+	m_timeBase = headerChunk.division;
+
+	for (const auto& chunk : indexTrackChunks(file, headerChunk.trackCount, m_options.log ? *m_options.log : std::clog)) {
+		m_trackData.push_back(chunk.data);
+		m_truncated.push_back(chunk.truncated);
+	}
+	m_tracks.resize(m_trackData.size());
+}
+
+LazySmf LazySmf::fromMemory(std::vector<uint8_t> data) {
+	return fromMemory(std::move(data), Smf::ReadOptions());
+}
+
+LazySmf LazySmf::fromMemory(std::vector<uint8_t> data, const Smf::ReadOptions& options) {
+	auto storage = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+	const std::span<const uint8_t> span(*storage);
+	return LazySmf(std::move(storage), span, options);
+}
+
+LazySmf LazySmf::fromFile(const std::filesystem::path& path) {
+	return fromFile(path, Smf::ReadOptions());
+}
+
+LazySmf LazySmf::fromFile(const std::filesystem::path& path, const Smf::ReadOptions& options) {
+	auto storage = std::make_shared<const MappedFile>(path);
+	const auto span = storage->data();
+	return LazySmf(std::move(storage), span, options);
+}
+
+const Smf::Track& LazySmf::track(size_t index) {
+	auto& cache = m_tracks.at(index);
+	if (!cache) {
+		const TrackChunkData chunk{ m_trackData[index], m_truncated[index] };
+		std::ostream& log = m_options.log ? *m_options.log : std::clog;		// 警告の出力先
+		DecodedTrack decoded;
+		if (m_options.arena) decoded.track = Smf::Track(std::make_shared<EventArena>(arenaInitialSize(chunk)));
+		decodeTrackChunk(chunk, m_options.intern, m_options.borrowPayload ? m_storage : nullptr, decoded, log);
+		if (decoded.error) {
+			warnException(decoded.error, log);
+			if (decoded.track.events().empty()) {	// まったくデコードできていなければ throw (キャッシュはしない)
+				std::rethrow_exception(decoded.error);
+			}
+		}
+		cache = std::make_unique<Smf::Track>(std::move(decoded.track));
+	}
+	return *cache;
+}
+
+std::optional<std::string> LazySmf::sequenceName(size_t index) const {
+	Cursor tr(m_trackData.at(index));
+	uint8_t runningStatus = 0;
+	try {
+		// デルタタイム0のイベントだけを走査する(ノート等はデコードせず読み飛ばす)
+		while (!tr.empty() && tr.readVariableValue() == 0) {
+			uint8_t status = tr.readByte();
+			if (!(status & 0x80)) {		// ランニングステータス
+				tr.unget();
+				status = runningStatus;
+			} else if (status < 0xf0) {
+				runningStatus = status;
+			}
+			switch (status & 0xf0) {
+			case EventProgramChange::statusByte:
+			case EventChannelPressure::statusByte:
+				tr.read(1);
+				continue;
+			case EventNoteOff::statusByte:
+			case EventNoteOn::statusByte:
+			case EventPolyphonicKeyPressure::statusByte:
+			case EventControlChange::statusByte:
+			case EventPitchBend::statusByte:
+				tr.read(2);
+				continue;
+			}
+			if (status == EventSystemExclusive::statusByteF0 || status == EventSystemExclusive::statusByteF7) {
+				tr.read(tr.readVariableValue());
+			} else if (status == EventMeta::statusByte) {
+				const auto type = static_cast<EventMeta::Type>(tr.readByte());
+				const auto data = tr.read(tr.readVariableValue());
+				if (type == EventMeta::Type::sequenceName) return std::string(data.begin(), data.end());
+				if (type == EventMeta::Type::endOfTrack) break;
+			} else if (status < 0x80) {	// 不正なステータス(ランニングステータスの前にステータスがない)
+				break;
+			}
+		}
+	} catch (const std::exception&) {
+		// 壊れたトラックは名前なしとする(警告はデコード時に出す)
+	}
+	return std::nullopt;
+}
+
+SmfReader::SmfReader(std::shared_ptr<const void> storage, std::span<const uint8_t> data)
+	:m_storage(std::move(storage))
+{
+	Cursor file(data);
+	const auto headerChunk = readHeaderChunk(file);
+	m_timeBase = headerChunk.division;
+
+	const auto chunks = indexTrackChunks(file, headerChunk.trackCount);
+	m_readers.reserve(chunks.size());
+	for (const auto& chunk : chunks) {
+		if (chunk.truncated) std::clog << "[warning] track data size error." << std::endl;	// データが足りない(が、エラーにはせず続行)
+		m_trackData.push_back(chunk.data);
+		m_readers.emplace_back(chunk.data);
+	}
+	m_pending.reserve(m_readers.size());
+}
+
+SmfReader SmfReader::fromMemory(std::span<const uint8_t> data) {
+	return SmfReader(nullptr, data);
+}
+
+SmfReader SmfReader::fromFile(const std::filesystem::path& path) {
+	auto storage = std::make_shared<const MappedFile>(path);
+	const auto span = storage->data();
+	return SmfReader(std::move(storage), span);
+}
+
+std::optional<SmfReader::Item> SmfReader::next() {
+	const auto later = [](const Item& a, const Item& b) {		// 位置、トラック順の最小ヒープにする
+		return std::tie(a.position, a.track) > std::tie(b.position, b.track);
+	};
+	const auto push = [&](size_t track, const std::optional<TrackReader::Item>& item) {
+		if (item) {
+			m_pending.push_back({ item->position, track, item->event });
+			std::push_heap(m_pending.begin(), m_pending.end(), later);
+		}
+	};
+
+	for (; m_fetched < m_readers.size(); m_fetched++) {		// 各トラックの先頭を先読み(例外が発生したら次回はそのトラックから)
+		push(m_fetched, m_readers[m_fetched].next());
+	}
+	if (m_pending.empty()) return std::nullopt;
+
+	// 取り出す前に同じトラックの次のイベントを読む(例外が発生しても m_pending は変わらない)
+	const Item item = m_pending.front();
+	const auto following = m_readers[item.track].next();
+	std::pop_heap(m_pending.begin(), m_pending.end(), later);
+	m_pending.pop_back();
+	push(item.track, following);
+	return item;
+}
+
+Smf::Track Smf::TrackBuilder::build() {
+	const auto less = [](const auto& a, const auto& b) {return a.first < b.first; };
+	if (!std::is_sorted(m_late.begin(), m_late.end(), less)) {
+		std::stable_sort(m_late.begin(), m_late.end(), less);
+	}
+	// multimap のノードは1つずつヒープから確保せず、トラックのアリーナにまとめて確保する
+	if (!m_arena) {
+		constexpr size_t nodeSize = sizeof(void*) * 4 + sizeof(Events::value_type);		// 木のノード(色・親・左右 + 値)の目安
+		m_arena = std::make_shared<EventArena>((std::max<size_t>)(size() * nodeSize, 256));
+	}
+	// 同じ位置なら m_events が先(m_late の要素はそれより前に追加された同じ位置の要素を追い越さない)
+	Track track(std::move(m_arena));
+	auto& events = track.mutableEvents();
+	auto late = m_late.begin();
+	for (auto& event : m_events) {
+		for (; late != m_late.end() && late->first < event.first; ++late) {
+			events.emplace_hint(events.end(), late->first, std::move(late->second));
+		}
+		events.emplace_hint(events.end(), event.first, std::move(event.second));
+	}
+	for (; late != m_late.end(); ++late) {
+		events.emplace_hint(events.end(), late->first, std::move(late->second));
+	}
+	m_events.clear();
+	m_late.clear();
+	return track;
+}
+
+namespace {
+
+	// 分解能の変換で丸めた結果を数える(トラック毎に作る)
+	class TimebaseCounter {
+		Smf::TimebaseStats&	m_stats;
+		bool				m_first = true;
+		size_t				m_beforeSrc = 0;		// 直前のイベントの位置(変換前)
+		size_t				m_beforeDst = 0;		// 直前のイベントの位置(変換後)
+		std::vector<std::pair<size_t, size_t>>	m_noteOn;	// [channel*128+note]=NoteOn の位置<変換前,変換後>(first == npos:なし)
+		static constexpr size_t npos = ~size_t(0);
+	public:
+		explicit TimebaseCounter(Smf::TimebaseStats& stats)
+			:m_stats(stats)
+			, m_noteOn(16 * 128, { npos, 0 })
+		{}
+		void add(size_t src, size_t dst, const midi::Event& event) {
+			if (!m_first && src != m_beforeSrc && dst == m_beforeDst) m_stats.collided++;
+			m_first = false;
+			m_beforeSrc = src;
+			m_beforeDst = dst;
+
+			const midi::EventNote* note = event.as<midi::EventNoteOn>();
+			const bool noteOn = note && note->velocity > 0;
+			if (!note) note = event.as<midi::EventNoteOff>();
+			if (!note) return;
+			auto& on = m_noteOn[note->channel * 128 + note->note];
+			if (noteOn) {
+				on = { src, dst };
+			} else if (on.first != npos) {
+				if (on.first != src && on.second == dst) m_stats.collapsedNotes++;
+				on.first = npos;
+			}
+		}
+	};
+
+}
+
 Smf Smf::convertTimebase(const Smf& smf, int timeBase) {
+	if (timeBase == smf.timeBase) return smf;
+	TimebaseStats stats;
+	return convertTimebase(smf, timeBase, stats);
+}
+
+Smf Smf::convertTimebase(const Smf& smf, int timeBase, TimebaseStats& stats) {
+	if (timeBase == smf.timeBase) return smf;
 	Smf dst;
 	dst.timeBase = timeBase;
-	const auto mul = static_cast<double>(dst.timeBase) / smf.timeBase;
 	for (auto& track : smf.tracks) {
+		TimebaseCounter counter(stats);
 		Track dstTrack;
-		for (auto& [position, event] : track.events) {
-			const auto dstPos = static_cast<decltype(position)>(std::round(position * mul));
-			dstTrack.events.emplace(dstPos, event);
+		auto& dstEvents = dstTrack.mutableEvents();
+		auto it = track.events().begin();
+		for (auto event : TimebaseView(track, smf.timeBase, timeBase)) {
+			counter.add((it++)->first, event.first, *event.second);
+			dstEvents.emplace_hint(dstEvents.end(), std::move(event));	// 位置の変換は単調増加なので順序は変わらない
 		}
-		dst.tracks.push_back(dstTrack);
+		dst.tracks.emplace_back(std::move(dstTrack));
 	}
 	return dst;
 }
+
+Smf::TimebaseStats Smf::rescaleTimebase(int timeBase) {
+	TimebaseStats stats;
+	if (timeBase == this->timeBase) return stats;
+	const auto mul = static_cast<double>(timeBase) / this->timeBase;
+	for (auto& track : tracks) {
+		TimebaseCounter counter(stats);
+		auto& events = track.mutableEvents();
+		Events dstEvents(events.get_allocator());
+		while (!events.empty()) {		// 先頭から取り外して位置を書き換え、末尾に付け替える(位置の変換は単調増加なので順序は変わらない)
+			auto node = events.extract(events.begin());
+			const auto src = node.key();
+			node.key() = TimebaseView::convertPosition(src, mul);
+			counter.add(src, node.key(), *node.mapped());
+			dstEvents.insert(dstEvents.end(), std::move(node));
+		}
+		events = std::move(dstEvents);
+	}
+	this->timeBase = timeBase;
+	return stats;
+}
+
+size_t Smf::arenaSize() const {
+	std::set<const EventArena*> arenas;		// トラック間で共有していれば1回だけ数える
+	size_t size = 0;
+	for (auto& track : tracks) {
+		if (const auto arena = track.arena(); arena && arenas.insert(arena.get()).second) {
+			size += arena->size();
+		}
+	}
+	return size;
+}
@@ -1,23 +1,163 @@
 ﻿#pragma once
 
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <iterator>
 #include <set>
 #include <list>
 #include <ostream>
 #include <map>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
 
+#include "EventStore.h"
 #include "MidiEvent.h"
 
 namespace rlib::midi {
 
+	// next() で値を取り出すリーダを range-for で回すためのイテレータ
+	template <typename Reader> class PullIterator {
+	public:
+		using value_type = typename decltype(std::declval<Reader&>().next())::value_type;
+		using difference_type = std::ptrdiff_t;
+		using iterator_category = std::input_iterator_tag;
+
+		PullIterator() {}
+		explicit PullIterator(Reader& reader)
+			:m_reader(&reader)
+			, m_current(reader.next())
+		{}
+		const value_type& operator*() const {
+			return *m_current;
+		}
+		const value_type* operator->() const {
+			return &*m_current;
+		}
+		PullIterator& operator++() {
+			m_current = m_reader->next();
+			return *this;
+		}
+		bool operator==(const PullIterator& b) const {
+			return m_current.has_value() == b.m_current.has_value();		// 終端との比較のみ
+		}
+	private:
+		Reader*						m_reader = nullptr;
+		std::optional<value_type>	m_current;
+	};
+
+	// トラックデータ(MTrk のデータ部)を先頭から1イベントずつデコードするリーダ
+	// イベントを保持しないので、メモリ使用量はトラックの長さによらず一定
+	class TrackReader {
+	public:
+		struct Item {
+			size_t		position;	// 絶対位置(tick)
+			EventView	event;
+		};
+
+		explicit TrackReader(std::span<const uint8_t> trackData);		// 警告は std::clog へ
+		TrackReader(std::span<const uint8_t> trackData, std::ostream& log);
+
+		std::optional<Item> next();		// 次のイベント(終端なら nullopt)。データが壊れていれば例外
+
+		PullIterator<TrackReader> begin() {
+			return PullIterator<TrackReader>(*this);
+		}
+		PullIterator<TrackReader> end() {
+			return PullIterator<TrackReader>();
+		}
+	private:
+		const uint8_t*	m_p;
+		const uint8_t*	m_end;
+		std::ostream*	m_log;
+		uint64_t		m_position = 0;
+		uint8_t			m_before = 0;		// 直前のステータス(0x80～0xef)
+		uint8_t			m_beforeF = 0;		// 直前のステータス(0x80～0xff) 違反チェック用
+	};
+
 	class Smf {
 	public:
-		using Events = std::multimap<size_t, std::shared_ptr<const midi::Event>>;	// <position,Event>
+		using Events = ArenaMultimap<size_t, std::shared_ptr<const midi::Event>>;	// <position,Event>
 		using Event = Events::value_type;
 
+		// 書き出しオプション
+		struct WriteOptions {
+			size_t	threads = 1;			// トラックのエンコードに使うスレッド数(0:ハードウェアのスレッド数) 2以上ならトラック毎に並列でエンコードする
+			bool	runningStatus = false;	// ランニングステータスでステータスバイトを省略し、NoteOff はベロシティ0の NoteOn で出力する
+			bool	cache = false;			// エンコード結果をトラックに保持し、変更のないトラックは再エンコードしない(同じ Smf を繰り返し書き出すエディタ等で使う。false なら中間バッファを作らずに書き出す)
+		};
+
+		// トラック
+		// エンコード結果(MTrk のデータ部)をキャッシュする。イベントの変更は mutableEvents() から行うこと(キャッシュを破棄する)
+		// キャッシュは runningStatus の有無毎に持つ。キャッシュを更新するので、同じ Track の書き出し(cache 指定時)や contentHash を複数スレッドから同時に行わないこと
 		class Track {
 		public:
-			Events	events;
+			// エンコード結果
+			struct Encoded {
+				bool					runningStatus = false;	// WriteOptions::runningStatus
+				std::vector<uint8_t>	data;					// MTrk のデータ部
+				uint64_t				hash = 0;				// data のハッシュ値(8Byte単位の FNV-1a)
+			};
+
+			Track() {}
+			explicit Track(std::shared_ptr<EventArena> arena)		// events とイベントを arena に確保する
+				:m_events(Events::allocator_type(std::move(arena)))
+			{}
+			std::shared_ptr<EventArena> arena() const {
+				return m_events.get_allocator().arena();
+			}
+
+			const Events& events() const {
+				return m_events;
+			}
+			Events& mutableEvents() {		// 変更用(キャッシュを破棄する。戻り値の参照を保持したまま書き出さないこと)
+				m_encoded = {};
+				return m_events;
+			}
+
+			std::shared_ptr<const Encoded> encoded(const WriteOptions& options) const;	// エンコード結果(キャッシュがなければエンコードしてキャッシュする)
+			uint64_t contentHash() const {			// 内容のハッシュ値(変更のないトラックの判別用。runningStatus なしのエンコード結果のハッシュ値)
+				return encoded(WriteOptions())->hash;
+			}
+			bool isCached(bool runningStatus = false) const {		// エンコード結果をキャッシュしているか(runningStatus:WriteOptions::runningStatus)
+				return m_encoded[runningStatus] != nullptr;
+			}
+
+		private:
+			Events									m_events;
+			mutable std::array<std::shared_ptr<const Encoded>, 2>	m_encoded;		// エンコード結果のキャッシュ [runningStatus](nullptr:未エンコード or 変更あり)
+		};
+
+		// イベントを位置順に関係なく vector へ追加していき、最後にまとめて Track を作る
+		// 位置が直前より戻ったイベント(先の位置に置いた NoteOff を次の NoteOn が追い越した等)は別の列に分けておき、
+		// build() でその列だけを安定ソートしてから位置順の列とマージする
+		// 同じ位置のイベントは追加順になる(Track::events へ1つずつ insert した場合と同じ順序)
+		class TrackBuilder {
+		public:
+			explicit TrackBuilder(std::shared_ptr<EventArena> arena = nullptr)	// arena は build() する Track のもの(nullptr なら build() で全ノード分の大きさのアリーナを作る)
+				:m_arena(std::move(arena))
+			{}
+			void reserve(size_t n) {
+				m_events.reserve(n);
+			}
+			size_t size() const {
+				return m_events.size() + m_late.size();
+			}
+			void add(size_t position, std::shared_ptr<const midi::Event> event) {
+				if (m_events.empty() || position >= m_events.back().first) {
+					m_events.emplace_back(position, std::move(event));
+				} else {
+					m_late.emplace_back(position, std::move(event));
+				}
+			}
+			Track build();		// ビルダーは空になる
+		private:
+			std::shared_ptr<EventArena>	m_arena;
+			std::vector<std::pair<size_t, std::shared_ptr<const midi::Event>>>	m_events;	// 位置順に追加されたもの
+			std::vector<std::pair<size_t, std::shared_ptr<const midi::Event>>>	m_late;		// 位置が戻ったもの
 		};
 	public:
 		int					timeBase = 480;			// 分解能(4分音符あたりのカウント)
@@ -35,17 +175,190 @@ namespace rlib::midi {
 
 		// SMFデータ取得
 		std::vector<uint8_t> getFileImage() const;
+		std::vector<uint8_t> getFileImage(const WriteOptions& options) const;
+
+		// SMFデータを ostream へ直接書き出す(WriteOptions の cache が false でスレッド数が1なら、トラック長は事前に算出して中間バッファは作らない)
+		void write(std::ostream& os) const;
+		void write(std::ostream& os, const WriteOptions& options) const;
 
 		friend std::ostream& operator<<(std::ostream& os, const Smf& smf) {
-			const auto v = smf.getFileImage();
-			os.write(reinterpret_cast<const char*>(v.data()), v.size());
+			smf.write(os);
 			return os;
 		}
 
-		static Smf fromStream(std::istream& is);
+		// 読み込みオプション
+		struct ReadOptions {
+			size_t	threads = 1;			// トラックのデコードに使うスレッド数(0:ハードウェアのスレッド数) 2以上ならトラック毎に並列でデコードする
+			std::ostream*	log = nullptr;	// 警告の出力先(nullptr:std::clog)
+			bool	arena = true;			// トラック毎のメモリアリーナにイベントを確保する(トラックの破棄時にまとめて解放)
+			bool	intern = true;			// 同じ内容のチャンネルメッセージはトラック内で1つの Event を共有する
+			bool	borrowPayload = true;	// 入力データを保持できる場合(owner の指定・fromStream・fromFile)、SysEx/メタのデータはコピーせずに入力データを参照する
+		};
+
+		// SMFデータ読み込み
+		static Smf fromMemory(std::span<const uint8_t> data);			// メモリ上のSMFデータから
+		static Smf fromMemory(std::span<const uint8_t> data, const ReadOptions& options);
+		static Smf fromMemory(const std::shared_ptr<const void>& owner, std::span<const uint8_t> data, const ReadOptions& options);	// owner が保持している data から(WASM のヒープ等。イベントが残っている間 owner を保持する)
+		static Smf fromStream(std::istream& is);						// ストリームから(全体を読み込んで fromMemory)
+		static Smf fromStream(std::istream& is, const ReadOptions& options);
+		static Smf fromFile(const std::filesystem::path& path);		// ファイルから(メモリマップして fromMemory)
+		static Smf fromFile(const std::filesystem::path& path, const ReadOptions& options);
+
+		// 分解能の変換で位置を丸めた結果
+		// 位置の変換は単調増加なので、位置順が入れ替わることはない。ただし別の位置のイベントが同じ位置にまとまることがある
+		struct TimebaseStats {
+			size_t	collided = 0;			// 直前のイベントと別の位置だったのに同じ位置になったイベントの数
+			size_t	collapsedNotes = 0;		// NoteOn と NoteOff が同じ位置になり、長さが0になったノートの数(同じ位置の NoteOff を先に処理する読み込み側では順序が入れ替わる)
+		};
+
+		// 分解能の変換
+		static Smf convertTimebase(const Smf& smf, int timeBase);		// 変換した Smf を作る(同じ分解能ならそのまま複製する)
+		static Smf convertTimebase(const Smf& smf, int timeBase, TimebaseStats& stats);
+		TimebaseStats rescaleTimebase(int timeBase);					// 自身を変換する(multimap のノードを付け替えるだけでイベントもノードも確保し直さない)
+
+		// トラックの位置を別の分解能に変換して参照するビュー(複製せず、走査時に位置を変換する)
+		// 参照先の Track より長く保持しないこと
+		class TimebaseView {
+		public:
+			class const_iterator {
+			public:
+				using value_type = Event;
+				using difference_type = std::ptrdiff_t;
+				using iterator_category = std::input_iterator_tag;
+
+				const_iterator() {}
+				const_iterator(Events::const_iterator it, double mul)
+					:m_it(it)
+					, m_mul(mul)
+				{}
+				value_type operator*() const {
+					return { convertPosition(m_it->first, m_mul), m_it->second };
+				}
+				const_iterator& operator++() {
+					++m_it;
+					return *this;
+				}
+				const_iterator operator++(int) {
+					auto t = *this;
+					++m_it;
+					return t;
+				}
+				bool operator==(const const_iterator& b) const {
+					return m_it == b.m_it;
+				}
+			private:
+				Events::const_iterator	m_it;
+				double					m_mul = 1;
+			};
+
+			TimebaseView(const Track& track, int srcTimeBase, int dstTimeBase)
+				:m_events(&track.events())
+				, m_mul(static_cast<double>(dstTimeBase) / srcTimeBase)
+			{}
+			const_iterator begin() const {
+				return const_iterator(m_events->begin(), m_mul);
+			}
+			const_iterator end() const {
+				return const_iterator(m_events->end(), m_mul);
+			}
+
+			static size_t convertPosition(size_t position, double mul) {	// mul:変換先の分解能/変換元の分解能
+				return static_cast<size_t>(std::round(position * mul));
+			}
+		private:
+			const Events*	m_events;
+			double			m_mul;
+		};
+
+		size_t arenaSize() const;		// トラックのメモリアリーナの大きさの合計(バイト)
+
+	};
+
+	// 遅延デコードする SMF
+	// 開いた時点ではヘッダの検証とトラックチャンクの位置の記録だけを行い、トラックは初めて参照された時にデコードしてキャッシュする
+	// キャッシュを更新するのでスレッドセーフではない
+	// ReadOptions の threads は使わない(1トラックずつデコードする)。log を指定した場合は LazySmf より長く保持すること
+	class LazySmf {
+		std::shared_ptr<const void>				m_storage;		// m_data の実体(メモリマップ or 読み込んだバッファ)
+		std::span<const uint8_t>				m_data;
+		Smf::ReadOptions						m_options;
+		int										m_timeBase = 480;
+		std::vector<std::span<const uint8_t>>	m_trackData;	// トラックチャンクのデータ部
+		std::vector<bool>						m_truncated;	// トラックデータがデータ長に足りない
+		std::vector<std::unique_ptr<Smf::Track>>	m_tracks;	// デコード済みトラック(未デコードは nullptr)
+
+		LazySmf(std::shared_ptr<const void> storage, std::span<const uint8_t> data, const Smf::ReadOptions& options);
+	public:
+		LazySmf(LazySmf&&) = default;
+		LazySmf& operator=(LazySmf&&) = default;
+
+		static LazySmf fromMemory(std::vector<uint8_t> data);		// SMFデータを受け取って保持する
+		static LazySmf fromMemory(std::vector<uint8_t> data, const Smf::ReadOptions& options);
+		static LazySmf fromFile(const std::filesystem::path& path);	// ファイルをメモリマップする
+		static LazySmf fromFile(const std::filesystem::path& path, const Smf::ReadOptions& options);
+
+		int timeBase() const {
+			return m_timeBase;
+		}
+		size_t trackCount() const {
+			return m_trackData.size();
+		}
+		bool isDecoded(size_t index) const {
+			return m_tracks.at(index) != nullptr;
+		}
+
+		// トラック取得(初回アクセス時にデコード)
+		const Smf::Track& track(size_t index);
+
+		// トラック先頭(位置0)のシーケンス名/トラック名 イベントをデコードせずに探す
+		std::optional<std::string> sequenceName(size_t index) const;
+
+		// トラックをキャッシュせずに逐次読む
+		TrackReader reader(size_t index) const {
+			return TrackReader(m_trackData.at(index));
+		}
+	};
+
+	// SMF の全トラックを位置順にマージしながら1イベントずつ読むリーダ(同じ位置ならトラック順)
+	// 保持するのはトラック毎のリーダと先読みした1イベントだけ
+	class SmfReader {
+	public:
+		struct Item {
+			size_t		position;	// 絶対位置(tick)
+			size_t		track;		// トラック番号
+			EventView	event;
+		};
+
+		static SmfReader fromMemory(std::span<const uint8_t> data);			// data は SmfReader より長く保持すること
+		static SmfReader fromFile(const std::filesystem::path& path);		// ファイルをメモリマップする
+
+		int timeBase() const {
+			return m_timeBase;
+		}
+		size_t trackCount() const {
+			return m_trackData.size();
+		}
+		TrackReader track(size_t index) const {		// 1トラックだけ読む(マージとは独立)
+			return TrackReader(m_trackData.at(index));
+		}
+
+		std::optional<Item> next();		// 次のイベント(終端なら nullopt)。データが壊れていれば例外
 
-		static Smf convertTimebase(const Smf& smf, int timeBase);
+		PullIterator<SmfReader> begin() {
+			return PullIterator<SmfReader>(*this);
+		}
+		PullIterator<SmfReader> end() {
+			return PullIterator<SmfReader>();
+		}
+	private:
+		SmfReader(std::shared_ptr<const void> storage, std::span<const uint8_t> data);
 
+		std::shared_ptr<const void>				m_storage;		// データの実体(fromFile の場合)
+		int										m_timeBase = 480;
+		std::vector<std::span<const uint8_t>>	m_trackData;
+		std::vector<TrackReader>				m_readers;
+		std::vector<Item>						m_pending;		// トラック毎に先読みしたイベント(ヒープ)
+		size_t									m_fetched = 0;	// 先頭を先読みしたトラック数
 	};
 
 }
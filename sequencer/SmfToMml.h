@@ -82,7 +82,7 @@ namespace rlib::sequencer {
 			return std::nullopt;
 		};
 
-		const auto makeMml = [&](const std::string& name, const std::string& instrument, int channel, const Smf::Events& events) {
+		const auto makeMml = [&](const std::string& name, const std::string& instrument, int channel, const midi::EventStore& events) {
 
 			struct {
 				int		note = -1;
@@ -176,9 +176,9 @@ namespace rlib::sequencer {
 				return result;
 			};
 
-			const std::map<std::type_index, std::function<Smf::Events::const_iterator(const Smf::Events::const_iterator&)> > map = {
-				{typeid(midi::EventNoteOn), [&](const Smf::Events::const_iterator& it) {
-					auto& e = static_cast<const midi::EventNoteOn&>(*it->second);
+			// イベントの型毎の処理(戻り値:次に処理するイベント)
+			const auto handlers = midi::utility::Overloaded{
+				[&](const midi::EventNoteOn& e, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
 					if (e.velocity <= 0) return std::next(it);	// NoteOff扱いのものは無視
 
 					std::string r;
@@ -189,25 +189,24 @@ namespace rlib::sequencer {
 						r += string::format("v%d", state.velocity);
 					}
 
-					// ノートオフか？
-					const auto isNoteOff = [&](const auto& spEvent) {
-						if (auto spNote = std::dynamic_pointer_cast<const midi::EventNote>(spEvent)) {
-							if (spNote->note == e.note) {
-								return spNote->velocity <= 0 || std::dynamic_pointer_cast<const midi::EventNoteOff>(spEvent);
-							}
+					// ノートオフか？(Event を生成せずに EventView のまま判定する)
+					const auto isNoteOff = [&](const midi::EventView& v) {
+						switch (v.status & 0xf0) {
+						case midi::EventNoteOff::statusByte:	return v.value(0) == e.note;
+						case midi::EventNoteOn::statusByte:		return v.value(0) == e.note && v.value(1) <= 0;
+						default:								return false;
 						}
-						return false;
 					};
 
 					// 音の長さ算出
 					const size_t len = [&]()->decltype(len) {
-						auto r = std::find_if(it, events.end(), [&](auto& x) {
-							return isNoteOff(x.second);
+						auto r = std::find_if(it, events.end(), [&](const auto& x) {
+							return isNoteOff(x.event);
 						});
 						if (r == events.end()) {
 							return 480 / 2;				// ノートオフがなければ8分音符
 						}
-						return r->first - it->first;
+						return (*r).position - (*it).position;
 					}();
 
 					static const std::vector<std::string> noteTable = {
@@ -235,7 +234,7 @@ namespace rlib::sequencer {
 						if (i == events.end()) {
 							return false;
 						}
-						if (isNoteOff(i->second) || i->first >= it->first + len) {	// ない?
+						if (isNoteOff((*i).event) || (*i).position >= (*it).position + len) {	// ない?
 							return false;
 						}
 						return true;
@@ -267,10 +266,9 @@ namespace rlib::sequencer {
 						mmls.emplace_back(std::move(vLen[i]));
 					}
 					return std::next(it);
-				}},
+				},
 
-				{typeid(midi::EventControlChange), [&](const Smf::Events::const_iterator& it) {
-					auto& e = static_cast<const midi::EventControlChange&>(*it->second);
+				[&](const midi::EventControlChange& e, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
 					switch (e.type) {
 					case midi::EventControlChange::Type::volume:
 						*mmls.rbegin() += string::format("V(%s)", static_cast<int>(e.value));
@@ -283,23 +281,23 @@ namespace rlib::sequencer {
 						return std::next(it);
 					case midi::EventControlChange::Type::rpnMSB:{
 						constexpr auto N = 4;	// 4個必要
-						std::vector<std::pair<size_t, std::shared_ptr<const midi::EventControlChange>>> list;
+						std::vector<midi::EventControlChange> list;
 						auto next = it;
 						for (; next != std::ranges::next(it, N, events.end()); next++) {
-							auto ev = std::dynamic_pointer_cast<const midi::EventControlChange>(next->second);
-							if (!ev) break;
-							list.emplace_back(next->first, ev);
+							const auto v = (*next).event;
+							if ((v.status & 0xf0) != midi::EventControlChange::statusByte) break;
+							list.emplace_back(v.channel(), v.value(0), v.value(1));
 						}
 						if (list.size() < N) break;
-						if (list[1].second->type != midi::EventControlChange::Type::rpnLSB) break;
-						if (list[2].second->type != midi::EventControlChange::Type::dataEntryMSB) break;
-						if (list[3].second->type != midi::EventControlChange::Type::dataEntryLSB) break;
+						if (list[1].type != midi::EventControlChange::Type::rpnLSB) break;
+						if (list[2].type != midi::EventControlChange::Type::dataEntryMSB) break;
+						if (list[3].type != midi::EventControlChange::Type::dataEntryLSB) break;
 						midi::utility::Bit14 type;
-						type.msb = list[0].second->value;
-						type.lsb = list[1].second->value;
+						type.msb = list[0].value;
+						type.lsb = list[1].value;
 						midi::utility::Bit14 value;
-						value.msb = list[2].second->value;
-						value.lsb = list[3].second->value;
+						value.msb = list[2].value;
+						value.lsb = list[3].value;
 
 						// FineTune
 						if (type.value == static_cast<uint16_t>(midi::EventControlChange::RpnType::fineTune)) {
@@ -329,24 +327,21 @@ namespace rlib::sequencer {
 					// バイナリデータとして出力
 					*mmls.rbegin() += string::format("CC(%s,%s)", static_cast<int>(e.type), static_cast<int>(e.value));
 					return std::next(it);
-				}},
+				},
 
-				{typeid(midi::EventProgramChange), [&](const Smf::Events::const_iterator& it) {
-					auto& e = static_cast<const midi::EventProgramChange&>(*it->second);
+				[&](const midi::EventProgramChange& e, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
 					*mmls.rbegin() += string::format("@%d", static_cast<int>(e.programNo));
 					return std::next(it);
-				}},
+				},
 
-				{typeid(midi::EventPitchBend), [&](const Smf::Events::const_iterator& it) {
-					auto& e = static_cast<const midi::EventPitchBend&>(*it->second);
+				[&](const midi::EventPitchBend& e, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
 					*mmls.rbegin() += string::format("PitchBend(%d)", static_cast<int>(e.pitchBend));
 					return std::next(it);
-				}},
+				},
 
-				{typeid(midi::EventSystemExclusive), [&](const Smf::Events::const_iterator& it) {
-					auto& e = static_cast<const midi::EventSystemExclusive&>(*it->second);
+				[&](const midi::EventSystemExclusive& e, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
 
-					auto isMatch = [](const std::vector<uint8_t>& data, const std::initializer_list<int16_t>& pattern) {
+					auto isMatch = [](const midi::Payload& data, const std::initializer_list<int16_t>& pattern) {
 						if (data.size() < pattern.size()) return false;
 						auto it = data.begin();
 						for (auto p : pattern) {
@@ -366,7 +361,7 @@ namespace rlib::sequencer {
 					}
 
 					// その他
-					const auto join = [](const std::vector<uint8_t>& v, const std::string& sep)->std::string {
+					const auto join = [](const midi::Payload& v, const std::string& sep)->std::string {
 						std::ostringstream oss;
 						for (size_t i = 0; i < v.size(); i++) {
 							if (i > 0) oss << sep;
@@ -377,10 +372,9 @@ namespace rlib::sequencer {
 
 					*mmls.rbegin() += string::format("\nSysEx(%s)", join(e.data, ","));
 					return std::next(it);
-				} },
+				},
 
-				{typeid(midi::EventMeta), [&](const Smf::Events::const_iterator& it) {
-					auto& e = static_cast<const midi::EventMeta&>(*it->second);
+				[&](const midi::EventMeta& e, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
 					switch (e.type) {
 					case midi::EventMeta::Type::tempo:
 						*mmls.rbegin() += string::format("t%s", e.getTempo());
@@ -458,36 +452,34 @@ namespace rlib::sequencer {
 						break;
 					}
 					// バイナリデータとして出力
-					const auto toJoinString = [](const std::vector<uint8_t>& v)-> std::string {	// std::vector<uint8_t> をカンマ区切りの文字列に変換
+					const auto toJoinString = [](const midi::Payload& v)-> std::string {	// バイト列をカンマ区切りの文字列に変換
 						std::ostringstream oss;
-						for (auto& n : v) {
+						for (const auto n : v) {
 							oss << "," << static_cast<unsigned int>(n);
 						}
 						return oss.str();
 					};
 					*mmls.rbegin() += string::format("\nMeta(type:0x%x%s)", static_cast<unsigned int>(e.type), toJoinString(e.data));
 					return std::next(it);
-				}},
+				},
 
+				[&](const midi::Event&, const midi::EventStore::const_iterator& it) -> midi::EventStore::const_iterator {
+					return std::next(it);	// その他は無視
+				},
 			};
 
 			for (auto it = events.begin(); it != events.end(); ) {
 				// delta time (休符)
-				if (const size_t len = it->first - state.position; len > 0) {
+				const size_t position = (*it).position;
+				if (const size_t len = position - state.position; len > 0) {
 					auto vLen = getLengthText(len, state.position, true);
 					*mmls.rbegin() += string::format("r%s", vLen[0]);
 					for (auto i = 1; i < vLen.size(); i++) {
 						mmls.emplace_back(std::move(vLen[i]));
 					}
-					state.position = it->first;
-				}
-				const auto& ev = *it->second;
-				if (auto i = map.find(typeid(ev)); i != map.end()) {
-					it = (i->second)(it);
-				} else {
-					// assert(false);
-					it++;
+					state.position = position;
 				}
+				it = (*it).event.visit([&](const auto& e) {return handlers(e, it); });
 			}
 
 			std::string result;
@@ -504,9 +496,7 @@ namespace rlib::sequencer {
 			return result;
 		};
 
-		auto smf2 = Smf::convertTimebase(smf, 480);		// timebaseを480に
-
-		using MapEvents = std::map<int, Smf::Events>;	// <ch,evnets>
+		using MapEvents = std::map<int, midi::EventStore>;	// <ch,evnets>
 
 		struct SmfTrack {
 			std::string		instrumentName;
@@ -532,10 +522,12 @@ namespace rlib::sequencer {
 
 			for (auto& track : smf.tracks) {
 				TrackKey trackKey;
-				for (auto& event : track.events) {
-					if (auto e = std::dynamic_pointer_cast<const midi::EventCh>(event.second)) {
-						resultMapTrack[trackKey][e->channel].insert(event);
-					} else if (auto e = std::dynamic_pointer_cast<const midi::EventMeta>(event.second)) {
+				for (const auto event : Smf::TimebaseView(track, smf.timeBase, 480)) {		// timebaseを480に
+					event.second->visit(midi::utility::Overloaded{
+					[&](const midi::EventCh& e) {
+						resultMapTrack[trackKey][e.channel].insert(event.first, e);
+					},
+					[&](const midi::EventMeta& e) {
 
 						const auto name = [&decodeText](const std::string& s)->std::optional<std::string> {
 
@@ -555,41 +547,51 @@ namespace rlib::sequencer {
 							return std::nullopt;
 						};
 
-						switch (e->type) {
+						switch (e.type) {
 						case midi::EventMeta::Type::sequenceName:
-							trackKey.sequenceName = name(e->getText()).value_or(TrackKey().sequenceName);
-							resultMapTrack[trackKey][metaChannel].insert(event);
+							trackKey.sequenceName = name(e.getText()).value_or(TrackKey().sequenceName);
+							resultMapTrack[trackKey][metaChannel].insert(event.first, e);
 							break;
 						case midi::EventMeta::Type::instrumentName:
-							trackKey.instrumentName = name(e->getText()).value_or(TrackKey().instrumentName);
-							resultMapTrack[trackKey][metaChannel].insert(event);
+							trackKey.instrumentName = name(e.getText()).value_or(TrackKey().instrumentName);
+							resultMapTrack[trackKey][metaChannel].insert(event.first, e);
 							break;
 						default:
-							resultMapTrack[trackKey][metaChannel].insert(event);
+							resultMapTrack[trackKey][metaChannel].insert(event.first, e);
 							break;
 						}
-					} else if (auto e = std::dynamic_pointer_cast<const midi::EventSystemExclusive>(event.second)) {
-						resultMapTrack[trackKey][metaChannel].insert(event);
-					} else {
-						assert(false);
-					}
+					},
+					[&](const midi::EventSystemExclusive& e) {
+						resultMapTrack[trackKey][metaChannel].insert(event.first, e);
+					},
+					});
 				}
 
 				// meta用トラックは一番若いチャンネルの列に
 				for (auto& i : resultMapTrack) {
 					if (auto j = i.second.find(metaChannel); j != i.second.end()) {
-						Smf::Events& dstEvents = i.second.size() <= 1 ? (i.second)[0] : i.second.begin()->second;
-						auto& events = j->second;
-						for (auto k = events.rbegin(); k != events.rend(); k++) {
-							dstEvents.insert(dstEvents.lower_bound(k->first), *k);
+						midi::EventStore& dstEvents = i.second.size() <= 1 ? (i.second)[0] : i.second.begin()->second;
+						const auto& metaEvents = j->second;
+						midi::EventStore merged;		// 同じ位置ではメタを先に
+						merged.reserve(dstEvents.size() + metaEvents.size());
+						auto k = metaEvents.begin();
+						for (const auto& [position, event] : dstEvents) {
+							for (; k != metaEvents.end() && (*k).position <= position; k++) {
+								merged.insert((*k).position, (*k).event);
+							}
+							merged.insert(position, event);
+						}
+						for (; k != metaEvents.end(); k++) {
+							merged.insert((*k).position, (*k).event);
 						}
+						dstEvents = std::move(merged);
 						i.second.erase(metaChannel);
 					}
 				}
 
 			}
 			return resultMapTrack;
-		}(smf2);
+		}(smf);
 
 		std::string result;
 
@@ -625,7 +627,7 @@ namespace rlib::sequencer {
 					return safeText(s);
 				}();
 
-				Smf::Events& events = iMapEvents.second;
+				const midi::EventStore& events = iMapEvents.second;
 
 				const auto mml = makeMml(trackName, instrument, channel, events);
 				result += mml;
@@ -1,5 +1,12 @@
 ﻿#pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
 namespace rlib {
 
 	template <typename T = double> class TempoListT {
@@ -39,7 +46,7 @@ namespace rlib {
 		typedef std::vector<Element> List;
 
 		bool operator==(const TempoListT& s)const {
-			return m_list == s.m_list;
+			return list() == s.list();
 		}
 		bool operator!=(const TempoListT& s)const {
 			return !(*this == s);
@@ -49,17 +56,46 @@ namespace rlib {
 		}
 		TempoListT(const TempoListT& s)
 			:m_list(s.m_list)
+			, m_deferred(s.m_deferred)
+			, m_dirty(s.m_dirty)
 		{}
 		TempoListT(TempoListT&& s)
 			:m_list(std::move(s.m_list))
+			, m_deferred(s.m_deferred)
+			, m_dirty(s.m_dirty)
 		{}
+		explicit TempoListT(List list) {
+			assign(std::move(list));
+		}
 
 		void clear() {
 			m_list.clear();
+			m_dirty = false;
+		}
+
+		// 一括設定(位置で安定ソートしてから time を1度だけ計算する。同じ位置のものは list の順で、insert を順に呼んだ場合と同じ結果)
+		void assign(List list) {
+			m_list = std::move(list);
+			std::stable_sort(m_list.begin(), m_list.end(), LessPosition());
+			updateTime(m_list.begin());
+			m_dirty = false;
+		}
+
+		// 更新の遅延
+		// true にすると insert/erase は追加・削除だけを行い、ソートと time の計算は次に参照した時(または false に戻した時)にまとめて行う
+		// 参照時に更新するので、遅延中は const のメンバ関数でもスレッドセーフではない
+		void setDeferred(bool deferred) {
+			m_deferred = deferred;
+			if (!deferred) update();
 		}
 
 		// Tempo 挿入
 		void insert(uint64_t position, T tempo) {
+			if (m_deferred) {
+				m_list.emplace_back(position, tempo);		// 同じ位置のものは追加順(update() で安定ソートする)
+				m_dirty = true;
+				return;
+			}
 			const auto i = m_list.insert(												// m_listPos に追加
 				std::upper_bound(m_list.begin(), m_list.end(), position, LessPosition()),	// 対象の値を超える最初
 				Element(position, tempo));
@@ -70,6 +106,10 @@ namespace rlib {
 		void erase(const typename List::const_iterator& i) {
 			const size_t index = i - m_list.begin();
 			m_list.erase(i);
+			if (m_deferred) {
+				m_dirty = true;
+				return;
+			}
 			updateTime(m_list.begin() + index);	// time 更新
 		}
 		// 削除（指定位置の指定テンポを削除。該当するものが複数ある場合は先のもののみ削除）
@@ -85,6 +125,7 @@ namespace rlib {
 
 		// 時間(秒)から位置(position)とテンポを取得
 		std::pair<uint64_t, T> getPositionAndTempo(T time)const {		// return pair<step,テンポ>
+			update();
 			const auto i = std::upper_bound(m_list.begin(), m_list.end(), time, LessTime());
 			Element tempoDefault;
 			const Element& t = i == m_list.begin() ? tempoDefault : *(i - 1);
@@ -95,17 +136,67 @@ namespace rlib {
 
 		// 位置(count)から時間(秒)を取得
 		T getTime(uint64_t position)const {
+			update();
 			const auto i = getUpperBound(position);
 			Element tempoDefault;
 			const Element& t = i == m_list.begin() ? tempoDefault : *(i - 1);
 			return t.time + ((position - t.position) * getSecPerCount(t.tempo));
 		}
 
+		// 位置(昇順)の列から時間(秒)の列を取得(結果は位置毎に getTime を呼んだ場合と同じ)
+		// テンポの区間を先頭から1度だけたどり、区間内は乗算と加算だけで求める(区間内のループは分岐がないのでベクトル化できる)
+		void getTimes(std::span<const uint64_t> positions, std::span<T> times)const {
+			assert(times.size() >= positions.size());
+			assert(std::is_sorted(positions.begin(), positions.end()));
+			update();
+			forEachSegment(positions, &Element::position, [&](const Element& t, size_t begin, size_t end) {
+				const uint64_t position = t.position;
+				const T time = t.time;
+				const T secPerCount = getSecPerCount(t.tempo);
+				for (size_t k = begin; k < end; k++) {
+					times[k] = time + ((positions[k] - position) * secPerCount);
+				}
+			});
+		}
+		std::vector<T> getTimes(std::span<const uint64_t> positions)const {
+			std::vector<T> times(positions.size());
+			getTimes(positions, times);
+			return times;
+		}
+
+		// 時間(秒、昇順)の列から位置(position)とテンポの列を取得(結果は時間毎に getPositionAndTempo を呼んだ場合と同じ)
+		void getPositionsAndTempos(std::span<const T> times, std::span<uint64_t> positions, std::span<T> tempos)const {
+			assert(positions.size() >= times.size() && tempos.size() >= times.size());
+			assert(std::is_sorted(times.begin(), times.end()));
+			update();
+			forEachSegment(times, &Element::time, [&](const Element& t, size_t begin, size_t end) {
+				const uint64_t position = t.position;
+				const T time = t.time;
+				const T countPerSec = getCountPerSec(t.tempo);
+				for (size_t k = begin; k < end; k++) {
+					positions[k] = position + static_cast<uint64_t>((times[k] - time) * countPerSec);
+				}
+				std::fill(tempos.begin() + begin, tempos.begin() + end, t.tempo);
+			});
+		}
+		std::vector<std::pair<uint64_t, T>> getPositionsAndTempos(std::span<const T> times)const {	// return vector<pair<step,テンポ>>
+			std::vector<uint64_t> positions(times.size());
+			std::vector<T> tempos(times.size());
+			getPositionsAndTempos(times, positions, tempos);
+			std::vector<std::pair<uint64_t, T>> result(times.size());
+			for (size_t k = 0; k < times.size(); k++) {
+				result[k] = std::make_pair(positions[k], tempos[k]);
+			}
+			return result;
+		}
+
 		std::pair<typename List::const_iterator, typename List::const_iterator> getEqualRange(uint64_t position)const {
+			update();
 			return std::make_pair(getLowerBound(position), getUpperBound(position));
 		}
 
 		const List& list()const {
+			update();
 			return m_list;
 		}
 
@@ -129,7 +220,30 @@ namespace rlib {
 			return std::upper_bound(m_list.begin(), m_list.end(), position, LessPosition());
 		}
 
-		void updateTime(typename List::iterator i) {	// time 更新
+		// keys(昇順)をテンポの区間毎に分けて f(区間のテンポ, begin, end) を呼ぶ
+		// keys[begin～end) は、upper_bound で探した場合に「区間のテンポ」の Element が見つかる範囲
+		template <typename Key, typename F> void forEachSegment(std::span<const Key> keys, Key Element::* member, F&& f)const {
+			Element tempoDefault;
+			const Element* t = &tempoDefault;
+			size_t begin = 0;
+			for (const auto& next : m_list) {
+				if (begin >= keys.size()) return;
+				const size_t end = std::lower_bound(keys.begin() + begin, keys.end(), next.*member) - keys.begin();	// next より前
+				if (end > begin) f(*t, begin, end);
+				begin = end;
+				t = &next;
+			}
+			if (begin < keys.size()) f(*t, begin, keys.size());
+		}
+
+		void update()const {		// 遅延していた更新を行う
+			if (!m_dirty) return;
+			std::stable_sort(m_list.begin(), m_list.end(), LessPosition());
+			updateTime(m_list.begin());
+			m_dirty = false;
+		}
+
+		void updateTime(typename List::iterator i)const {	// time 更新
 			Element tempoDefault;
 			Element* pBefore = i == m_list.begin() ? &tempoDefault : &*(i - 1);
 			for (; i != m_list.end(); i++) {
@@ -138,7 +252,9 @@ namespace rlib {
 			}
 		}
 	private:
-		List	m_list;
+		mutable List	m_list;				// mutable:遅延していた更新を参照時に行うため
+		bool			m_deferred = false;
+		mutable bool	m_dirty = false;	// 遅延していた更新がある
 	};
 
 	using TempoListF = TempoListT<float>;
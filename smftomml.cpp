@@ -3,6 +3,7 @@
 
 #include <boost/program_options.hpp>
 
+#include "./batch/Batch.h"
 #include "./stringformat/StringFormat.h"
 #include "./sequencer/SmfToMml.h"
 
@@ -14,12 +15,17 @@ int main(const int argc, const char* const argv[])
 
 	try {
 		std::string input, output;
+		size_t threads = 1;
+		size_t jobs = 0;
 		po::options_description desc("options");
 		desc.add_options()
 			("version", "show version")
 			("help", "show help")
 			("input,i", po::value(&input)->required(), "input file (required)")		// 入力ファイルパス(mml)
 			("output,o", po::value(&output)->required(), "output file (required)")	// 出力ファイル(mid)
+			("threads", po::value(&threads)->default_value(1), "threads for track decoding (0: hardware concurrency)")	// トラックを並列でデコードするスレッド数
+			("batch", "batch mode: input is a directory or a list file, output is a directory. prints a JSON summary")
+			("jobs,j", po::value(&jobs)->default_value(0), "worker threads for batch mode (0: hardware concurrency)")
 			;
 
 		po::positional_options_description pd;
@@ -40,17 +46,22 @@ int main(const int argc, const char* const argv[])
 
 		po::notify(vm);
 
-		auto fs = [&] {
-			auto path = std::filesystem::path(input);
-			std::fstream fs(path, std::ios::in | std::ios::binary);
-			if (fs.fail()) {
-				throw std::runtime_error("input file open error.");
-			}
-			return fs;
-		}();
+		if (vm.count("batch")) {		// バッチ変換
+			const auto items = batch::listInputs(input, { ".mid", ".midi", ".smf" });
+			const auto summary = batch::run(items, jobs, [&](const batch::Item& item, std::ostream& log) {
+				const auto smf = midi::Smf::fromFile(item.input, { .threads = threads, .log = &log });
+				const std::string mml = sequencer::smfToMml(smf);
+
+				std::ofstream os(batch::outputPath(output, item, ".mml"), std::ios::out | std::ios::binary | std::ios::trunc);
+				if (os.fail()) throw std::runtime_error("output file open error.");
+				os.write(mml.data(), mml.size());
+			});
+			std::cout << summary << std::endl;
+			return summary["failed"].get<size_t>() > 0 ? 1 : 0;
+		}
 
 		try {
-			auto smf = midi::Smf::fromStream(fs);
+			auto smf = midi::Smf::fromFile(std::filesystem::path(input), { .threads = threads });
 			const std::string mml = sequencer::smfToMml(smf);
 
 			auto path = std::filesystem::path(output);
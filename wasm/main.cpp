@@ -5,6 +5,7 @@
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <span>
 #include <sstream>
 #include <regex>
 #include <exception>
@@ -13,6 +14,14 @@
 #include "../sequencer/MmlToSmf.h"
 #include "../sequencer/SmfToMml.h"
 
+// Smf のファイルイメージを Uint8Array にして ret.result に設定する
+static void setSmfResult(emscripten::val& ret, const rlib::midi::Smf& smf) {
+	const auto v = smf.getFileImage();
+	const auto uint8Array = emscripten::val::global("Uint8Array").new_(v.size());
+	uint8Array.call<void>("set", emscripten::typed_memory_view(v.size(), v.data()));	// wasm側のメモリをコピー
+	ret.set("result", uint8Array);
+}
+
 emscripten::val mmlToSmf(const std::string& mml) {
 	auto ret = emscripten::val::object();
 	try {
@@ -22,10 +31,7 @@ emscripten::val mmlToSmf(const std::string& mml) {
 			const auto errorJson = r.mmlResult.getJson(r.mmlResult.errors);
 			ret.set("error", errorJson);
 		} else {
-			const auto v = r.smf.getFileImage();
-			const auto uint8Array = emscripten::val::global("Uint8Array").new_(v.size());
-			uint8Array.call<void>("set", emscripten::typed_memory_view(v.size(), v.data()));	// wasm側のメモリをコピー
-			ret.set("result", uint8Array);
+			setSmfResult(ret, r.smf);
 		}
 	} catch (const std::exception& e) {
 		// std::cout << "mmlToSmf std::exception" << std::endl;
@@ -37,14 +43,38 @@ emscripten::val mmlToSmf(const std::string& mml) {
 	return ret;
 }
 
+// 編集中の MML を繰り返し変換する(変更のあった行からコンパイルし直す)
+// 戻り値は mmlToSmf と同じ
+class MmlSession {
+public:
+	emscripten::val mmlToSmf(const std::string& mml) {
+		auto ret = emscripten::val::object();
+		try {
+			const auto& r = m_session.update(mml);
+			if (!r.errors.empty()) {
+				ret.set("error", r.getJson(r.errors));
+			} else {
+				setSmfResult(ret, rlib::sequencer::mmlToSmf(r));
+			}
+		} catch (const std::exception& e) {
+			ret.set("error", emscripten::val::u8string(e.what()));
+		} catch (...) {
+			ret.set("error", emscripten::val::u8string("unknown exception"));
+		}
+		return ret;
+	}
+
+private:
+	rlib::sequencer::MmlCompiler::Session	m_session;
+};
 
 
 emscripten::val smfToMml(const std::string& smfBinary) {
 	auto ret = emscripten::val::object();
 	try {
 		// std::cout << "smfToMml" << std::endl;
-		std::istringstream is(smfBinary, std::istringstream::binary);
-		auto smf = rlib::midi::Smf::fromStream(is);
+		const auto data = std::span(reinterpret_cast<const uint8_t*>(smfBinary.data()), smfBinary.size());
+		auto smf = rlib::midi::Smf::fromMemory(data);
 		const auto mml = rlib::sequencer::smfToMml(smf);
 		ret.set("result", emscripten::val::u8string(mml.c_str()));
 		ret.set("ok", true);
@@ -63,4 +93,7 @@ emscripten::val smfToMml(const std::string& smfBinary) {
 EMSCRIPTEN_BINDINGS(module) {
 	emscripten::function("mmlToSmf", &mmlToSmf);
 	emscripten::function("smfToMml", &smfToMml);
+	emscripten::class_<MmlSession>("MmlSession")
+		.constructor<>()
+		.function("mmlToSmf", &MmlSession::mmlToSmf);
 }